@@ -4,6 +4,51 @@
 #include <vector>
 #include <numbers>
 #include <algorithm>
+#include <array>
+#include <cmath>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <optional>
+#include <functional>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <limits>
+
+#include <semaphore>
+#include <filesystem>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#define ANISOTROPINATOR_MMAP 1
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/inotify.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define ANISOTROPINATOR_IO_URING 1
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb/stb_image.h"
@@ -18,34 +63,385 @@ enum class Type
     e2D,
     eAngle
 };
+// Image memory comes from a pool of 64 byte aligned buffers that are recycled between
+// conversions instead of being returned to the heap
+void* acquireBuffer(size_t size);
+void releaseBuffer(void* memory, size_t size);
+void reportBufferPool();
+void trimBufferPool();
+// NUMA node whose free buffers the calling thread draws from; set by the workers of a NUMA
+// aware pool, so recycled buffers stay on the node that first touched them
+inline thread_local int currentNumaNode = 0;
+
+// What backs buffers of at least a huge page; each falls back to the next when unavailable
+enum class HugePages
+{
+    eOff,
+    eTransparent,
+    eExplicit
+};
+void setHugePages(HugePages mode);
+
+// Allocator for image bytes. resize() default-initializes, leaving the bytes a kernel is
+// about to overwrite untouched instead of zeroing them first.
+template <typename T>
+struct PooledAllocator
+{
+    using value_type = T;
+
+    PooledAllocator() = default;
+    template <typename U>
+    PooledAllocator(const PooledAllocator<U>&)
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(acquireBuffer(n * sizeof(T)));
+    }
+    void deallocate(T* memory, size_t n)
+    {
+        releaseBuffer(memory, n * sizeof(T));
+    }
+
+    template <typename U>
+    void construct(U* memory)
+    {
+        ::new (static_cast<void*>(memory)) U;
+    }
+    template <typename U, typename... Args>
+    void construct(U* memory, Args&&... args)
+    {
+        ::new (static_cast<void*>(memory)) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    bool operator==(const PooledAllocator<U>&) const
+    {
+        return true;
+    }
+};
+using ImageBytes = std::vector<uint8_t, PooledAllocator<uint8_t>>;
+
 struct AnisotropyData
 {
-    std::vector<uint8_t> data;
+    ImageBytes data;
     int width = 0;
     int height = 0;
     int numChannels = 0;
     Type type;
 };
 
+// The same image as separate x, y and strength planes (angle and strength for eAngle, with
+// the third plane unused by 2D and angle), so kernels load whole vectors of one channel.
+// Rows are padded to a multiple of 64 bytes and every plane starts 64 byte aligned. The
+// planar conversions keep a single row in one, so no full size copy is ever made.
+struct PlanarImage
+{
+    static constexpr size_t alignment = 64;
+    static constexpr int numPlanes = 3;
+
+    struct Release
+    {
+        size_t size;
+        void operator()(uint8_t* memory) const
+        {
+            releaseBuffer(memory, size);
+        }
+    };
+
+    std::unique_ptr<uint8_t[], Release> memory;
+    int width = 0;
+    int height = 0;
+    size_t stride = 0;
+    Type type;
+
+    uint8_t* plane(int index)
+    {
+        return memory.get() + index * stride * height;
+    }
+    const uint8_t* plane(int index) const
+    {
+        return memory.get() + index * stride * height;
+    }
+    uint8_t* row(int index, int y)
+    {
+        return plane(index) + y * stride;
+    }
+    const uint8_t* row(int index, int y) const
+    {
+        return plane(index) + y * stride;
+    }
+};
+
+// Raw output container. The header fills the first page and each mip level starts on a
+// page boundary, so a mapping of the file can be used level by level without decoding.
+// Fields are little endian.
+constexpr size_t rawPageSize = 4096;
+constexpr char rawMagic[8] = { 'A', 'N', 'I', 'S', 'O', 'R', 'A', 'W' };
+struct RawLevel
+{
+    uint64_t offset;
+    uint32_t width;
+    uint32_t height;
+    uint32_t rowBytes;
+    uint32_t reserved;
+};
+struct RawHeader
+{
+    static constexpr uint32_t maxLevels = 32;
+    char magic[8];
+    uint32_t version;
+    uint32_t type;
+    uint32_t numChannels;
+    uint32_t numLevels;
+    RawLevel levels[maxLevels];
+};
+static_assert(sizeof(RawHeader) <= rawPageSize);
+
+// <output>.tiles, written by --incremental: this header followed by numTiles 64-bit hashes of
+// the input tiles, row by row. The rest records what the output was converted from and with,
+// and the size and modification time it was left with, so any other write to it is noticed.
+constexpr int incrementalTileSize = 256;
+constexpr char tilesMagic[8] = { 'A', 'N', 'I', 'S', 'O', 'T', 'I', 'L' };
+struct TilesHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t tileSize;
+    uint32_t inputType;
+    uint32_t outputType;
+    uint32_t width;
+    uint32_t height;
+    uint32_t encoder;
+    uint32_t dither;
+    uint64_t numTiles;
+    uint64_t outputSize;
+    int64_t outputModified;
+};
+
+enum class Encoder
+{
+    eTruncate,
+    eOptimal
+};
+enum class Dither
+{
+    eNone,
+    eOrdered,
+    eDiffusion
+};
+enum class Layout
+{
+    eInterleaved,
+    ePlanar
+};
+enum class OutputFormat
+{
+    ePng,
+    eRaw
+};
+enum class ResizeFilter
+{
+    eBox,
+    eKaiser,
+    eLanczos
+};
+// A channel of another texture copied into a packed output
+struct PackInput
+{
+    int channel = 0;
+    std::string filename;
+    int sourceChannel = 0;
+};
+struct ConversionOptions
+{
+    Encoder encoder = Encoder::eTruncate;
+    Dither dither = Dither::eNone;
+    bool roundtripReport = false;
+    Layout layout = Layout::ePlanar;
+    OutputFormat format = OutputFormat::ePng;
+    bool mips = false;
+    std::string outputFile;
+    std::string outputRoot;
+    std::string inputRoot;
+    std::string packChannels;
+    std::vector<PackInput> packInputs;
+    // with levels, only mip levels firstLevel..lastLevel are output; lastLevel -1 runs to 1x1
+    bool levels = false;
+    int firstLevel = 0;
+    int lastLevel = -1;
+    // with resize, outputs are resampled to resizeWidth x resizeHeight, or by resizeScale when
+    // that is set
+    bool resize = false;
+    int resizeWidth = 0;
+    int resizeHeight = 0;
+    float resizeScale = 0.f;
+    ResizeFilter filter = ResizeFilter::eLanczos;
+    // with incremental, raw outputs are patched where the input changed since the last run
+    bool incremental = false;
+};
+
 // Prototypes for optional outputs
 AnisotropyData loadData(const std::string& filename, Type anisotropyType);
+AnisotropyData loadDataFromMemory(const std::string& filename, const uint8_t* bytes, size_t size, Type anisotropyType);
+AnisotropyData loadDataFromStdin(Type anisotropyType);
 AnisotropyData old3_to_new3(const AnisotropyData& input);
 AnisotropyData angle_to_new3(const AnisotropyData& input);
 AnisotropyData mag2d_to_new3(const AnisotropyData& input);
 AnisotropyData mag2d_to_angle(const AnisotropyData& input);
 AnisotropyData new3_to_angle(const AnisotropyData& input);
 AnisotropyData new3_to_mag2d(const AnisotropyData& input);
-void writeData(const std::string& inputfilename, const AnisotropyData& transformed);
+AnisotropyData new3_to_mag2d_optimal(const AnisotropyData& input);
+PlanarImage allocatePlanar(int width, int height, Type type);
+void deinterleaveRow(const AnisotropyData& input, int y, PlanarImage& row);
+void interleaveRow(const PlanarImage& row, AnisotropyData& output, int y);
+AnisotropyData new3_to_mag2d_planar(const AnisotropyData& input);
+AnisotropyData mag2d_to_new3_planar(const AnisotropyData& input);
+AnisotropyData dither_to_mag2d_or_angle(const AnisotropyData& input, Type outtype, Dither dither);
+AnisotropyData convertData(AnisotropyData loaded, Type outtype, const ConversionOptions& options);
+bool parseLevels(std::string_view range, ConversionOptions& options);
+bool parseResize(std::string_view size, ConversionOptions& options);
+std::string optionConflicts(const ConversionOptions& options);
+bool writeData(const std::string& inputfilename, const AnisotropyData& transformed, const ConversionOptions& options);
+std::string outputStem(const std::string& inputfilename, Type type, const ConversionOptions& options);
+std::string outputFilename(const std::string& inputfilename, Type type, const ConversionOptions& options);
+bool createParentDirectories(const std::string& filename);
+std::vector<uint8_t> encodeData(const AnisotropyData& transformed, const ConversionOptions& options);
+AnisotropyData packChannels(const std::string& inputfilename, const AnisotropyData& transformed, const ConversionOptions& options);
+
+// Prototypes for the raw container and mip chains
+int rawChannels(Type type);
+std::vector<uint8_t> encodeRaw(const AnisotropyData& transformed, bool mips);
+std::vector<uint8_t> encodeRawLevels(const std::vector<const AnisotropyData*>& levels);
+bool rawLevelFits(const RawHeader& header, const RawLevel& level, uint64_t size);
+AnisotropyData decodeRaw(const std::string& filename, const uint8_t* bytes, size_t size, Type anisotropyType);
+std::vector<float> toStrengthVectors(const AnisotropyData& input);
+AnisotropyData fromStrengthVectors(const std::vector<float>& vectors, int width, int height, Type type);
+std::vector<float> downsampleVectors(const std::vector<float>& vectors, int& width, int& height);
+AnisotropyData downsample(const AnisotropyData& input);
+std::vector<AnisotropyData> convertLevels(const AnisotropyData& loaded, Type outtype, const ConversionOptions& options);
+std::string levelFilename(const std::string& filename, int level);
+int mipLevelCount(int width, int height);
+AnisotropyData resizeData(const AnisotropyData& loaded, Type outtype, const ConversionOptions& options);
+AnisotropyData sliceRows(const AnisotropyData& image, int beginRow, int endRow);
+
+// Prototypes for analysis modes
+struct ErrorStats;
+int runAnalysis(const std::string& reportfilename, const std::string& texturefilename, Type textureType, const ConversionOptions& options);
+AnisotropyData convertWithRoundtrip(AnisotropyData loaded, Type outtype, const ConversionOptions& options, ErrorStats& stats, AnisotropyData& errorImage);
+void writeRoundtripReport(const std::string& inputfilename, const AnisotropyData& transformed, const ErrorStats& stats, const AnisotropyData& errorImage, const ConversionOptions& options);
+
+// Prototypes for batch processing
+struct FileJob;
+void convertJob(FileJob& job, Type outtype, const ConversionOptions& options);
+bool writeJob(const FileJob& job, const ConversionOptions& options);
+class AsyncFileIO;
+bool writeJobAsync(const FileJob& job, const ConversionOptions& options, AsyncFileIO& io, std::function<void(bool ok)> done);
+bool writeLevels(const FileJob& job, const ConversionOptions& options, AsyncFileIO* io, std::function<void(bool ok)> done = {});
+void convertIncremental(FileJob& job, Type outtype, const ConversionOptions& options);
+bool writeIncremental(const FileJob& job, const ConversionOptions& options);
+enum class Scheduler
+{
+    ePipeline,
+    eWorkStealing
+};
+enum class IOBackend
+{
+    eStdio,
+    eThreads,
+    eUring
+};
+struct PipelineOptions
+{
+    Scheduler scheduler = Scheduler::ePipeline;
+    IOBackend io = IOBackend::eStdio;
+    int workerThreads = std::max(1u, std::thread::hardware_concurrency());
+    int decodeThreads = std::max(1u, std::thread::hardware_concurrency() / 4);
+    int convertThreads = std::max(1u, std::thread::hardware_concurrency() / 4);
+    int encodeThreads = std::max(1u, std::thread::hardware_concurrency() / 2);
+    int queueDepth = 4;
+    bool numa = false;
+    bool watch = false;
+    // worker processes the batch is sharded over; 1 keeps it in this process
+    int processes = 1;
+};
+// A NUMA node and the CPUs on it
+struct NumaNode
+{
+    int id = 0;
+    std::vector<int> cpus;
+};
+std::vector<NumaNode> numaTopology();
+bool pinCurrentThread(const std::vector<int>& cpus);
+uint64_t hashWords(const uint8_t* bytes, size_t size);
+uint64_t fnv1a64(const uint8_t* bytes, size_t size);
+int runWatch(const std::vector<std::string>& inputs, Type inputtype, Type outtype, const ConversionOptions& options, const PipelineOptions& pipelineOptions);
+int runSharded(const std::vector<std::string>& filenames, Type inputtype, Type outtype, const ConversionOptions& options, const PipelineOptions& pipelineOptions);
+int runPipeline(const std::vector<std::string>& filenames, Type inputtype, Type outtype, const ConversionOptions& options, const PipelineOptions& pipelineOptions);
+int runWorkStealing(const std::vector<std::string>& filenames, Type inputtype, Type outtype, const ConversionOptions& options, const PipelineOptions& pipelineOptions);
+
+// Prototypes for rendering
+enum class Shape
+{
+    ePlane,
+    eSphere
+};
+struct RenderOptions
+{
+    Shape shape = Shape::ePlane;
+    int size = 512;
+    float roughness = 0.4f;
+    float maxRmse = -1.f;
+};
+int runRender(const std::string& outputfilename, const std::vector<std::pair<std::string, Type>>& inputs, const RenderOptions& renderOptions);
+
+// Prototypes for texture arrays and atlases
+struct ArrayOptions
+{
+    int padding = 2;
+};
+int runArray(const std::string& outputfilename, const std::vector<std::string>& filenames, Type inputtype, Type outtype, const ConversionOptions& options,
+    const PipelineOptions& pipelineOptions, const ArrayOptions& arrayOptions);
+
+// Prototypes for glTF scenes
+struct JsonValue;
+bool parseJson(std::string_view text, JsonValue& value, std::string& error);
+void writeJson(std::string& out, const JsonValue& value, int depth = 0);
+std::string jsonQuoted(const std::string& text);
+std::string commonDirectory(const std::vector<std::string>& filenames);
+int runGltf(const std::string& scenefilename, Type inputtype, Type outtype, const ConversionOptions& options, const PipelineOptions& pipelineOptions);
+
+// Prototypes for benchmarking
+struct BenchmarkOptions
+{
+    int repeat = 5;
+    int scale = 1;
+};
+int runBenchmark(const std::string& texturefilename, Type inputtype, Type outtype, const ConversionOptions& options, const BenchmarkOptions& benchmarkOptions);
+
+// Prototypes for job manifests
+int runManifest(const std::string& jobfilename, const std::string& resultfilename, const ConversionOptions& options, const PipelineOptions& pipelineOptions);
 
 std::string_view usage()
 {
     return R"(
-Usage: anisotropinator.exe <inputfile> <inputtype> <outputtype>
+Usage: anisotropinator.exe <inputfile>... <inputtype> <outputtype> [options]
+       anisotropinator.exe analyze <reportfile> [<inputfile> <inputtype>] [options]
+       anisotropinator.exe render <outputfile> <inputfile> <inputtype> [<inputfile2> <inputtype2>] [options]
+       anisotropinator.exe gltf <scene.gltf> [<inputtype>] <outputtype> [options]
+       anisotropinator.exe array <outputfile> <inputfile>... <inputtype> <outputtype> [options]
+       anisotropinator.exe benchmark <inputfile> <inputtype> <outputtype> [options]
+       anisotropinator.exe manifest <jobfile> [<resultfile>] [options]
     Simple utility created for us to evaluate encoding anisotropy texture data in 2 channels, 
     with xy representing a 2D vector and strength encoded as the magnitude of the vector.
 
 Inputs:
-    <inputfile> - An anisotropy texture encoded in 3 channels: x,y direction and anisotropy strength
+    <inputfile> - An anisotropy texture encoded in 3 channels: x,y direction and anisotropy strength.
+                  Several files may be given; they are converted by a pipeline that decodes,
+                  converts and encodes different files at the same time.
+                  A single - reads the texture from stdin and, unless -o is given, writes the
+                  output to stdout. Messages go to stderr whenever stdout carries the output.
     <inputtype> - Describes how anisotropy is encoded in the <inputfile>
                   3channel - anisotropy is encoded as a 2D direction and a strength [0-1]
                   3channel2 - anisotropy is encoded as a 2D direction and a strength [-1-1]
@@ -69,6 +465,181 @@ Outputs:
     <inputfile>.angle.png -       anisotropy file encoded as 2 channels; an angle direction 
                                   and strength. This is produced by loading the transformed.png
                                   and encoding into this representation.
+
+    <inputfile>.[postfix].raw -   with --format raw; an uncompressed container meant to be
+                                  memory mapped. A 4 KiB header page (magic "ANISORAW",
+                                  version, type, bytes per texel, level count and per level
+                                  offset, width, height and row bytes, all little endian)
+                                  followed by each level on its own 4 KiB aligned pages, rows
+                                  tightly packed with 2 bytes per texel for 2D and angle and 3
+                                  for 3channel. Raw files are accepted as <inputfile>s too.
+
+Output location:
+    -o <outputfile>         - write the output of a single <inputfile> to <outputfile> instead;
+                              - writes it to stdout
+    --output-root <dir>     - write outputs under <dir>, mirroring where each <inputfile> sits
+                              below the input root, so the source tree is left untouched
+    --input-root <dir>      - the input root for --output-root (default: the deepest directory
+                              containing every <inputfile>)
+
+Options:
+    --encoder <name>   - how 3channel inputs are quantized to 2D, also used by analyze
+                         truncate - scale the direction by the strength and truncate to 8 bits (default)
+                         optimal  - pick the 2D code whose decoded direction and strength are closest
+                                    to the input, weighing 1 radian of angular error like a
+                                    strength error of 1
+    --dither <mode>    - dither the quantization of 2D vectors and angles to break up banding.
+                         Dithering is done in vector space and replaces --encoder.
+                         ordered   - 8x8 Bayer matrix thresholds
+                         diffusion - Floyd-Steinberg error diffusion, processed as a wavefront
+                                     across threads
+    --layout <name>    - memory layout the 3channel <-> 2D conversions run on
+                         planar      - separate, 64 byte aligned x, y and strength planes,
+                                       converted a row of one channel at a time (default)
+                         interleaved - the decoded RGB pixels, one pixel at a time
+    --format <name>    - png - deflated PNG (default)
+                         raw - the memory mappable container described above
+    --mips             - with --format raw, append a mip chain down to 1x1, box filtered in vector
+                         space (direction scaled by strength)
+    --levels <range>   - output only mip levels <first>..<last>, <first>..end or a single <first>,
+                         e.g. 2..end for previews. The first level below full resolution is box
+                         filtered in vector space straight from the input, a band of rows at a
+                         time, without converting the full resolution image; the rest follow as
+                         with --mips. PNG outputs are written per level as
+                         <inputfile>.[postfix].mip<n>.png; --format raw puts the requested
+                         levels in one container, largest first. Level 0 is converted with the
+                         options above; the others are quantized by truncation.
+    --incremental      - with --format raw, keep the hash of every 256x256 tile of the input in
+                         <output>.tiles and on later runs reconvert only the tiles whose hash
+                         changed, rewriting just those texels of the existing output. Everything
+                         is converted when the sidecar, the output or the options don't match,
+                         including when the output was written since by anything else.
+    --resize <size>    - resample outputs to <width>x<height> or by <percent>%, e.g. 50%, filtering
+                         in vector space so directions aren't blended independently of strength,
+                         in the same pass as the conversion. Quantized by truncation.
+    --filter <name>    - box     - average of the input texels each output texel covers
+                         kaiser  - a sinc of width 3 under a Kaiser window (alpha 4)
+                         lanczos - Lanczos 3 (default)
+    --pack <channels>  - write the anisotropy channels to <channels> of the output instead, e.g. ba
+                         puts a 2D or angle output in blue and alpha; 3channel outputs take three
+    --pack-input <c>=<file>[:<sourcechannel>]
+                       - fill output channel <c> (r, g, b or a) from <sourcechannel> of <file>
+                         (default r) in the same pass. {stem} in <file> is replaced by the
+                         <inputfile> without its extension, so each file of a batch can be packed
+                         with its own maps. Outputs get 4 channels when a is used. PNG only.
+    --huge-pages <mode> - back image buffers of 2 MiB and more with huge pages, which cuts TLB
+                          misses on very large textures
+                          off      - regular pages (default)
+                          thp      - 2 MiB aligned mappings advised for transparent huge pages
+                          explicit - MAP_HUGETLB pages reserved in /proc/sys/vm/nr_hugepages,
+                                     falling back to thp, then to regular pages
+    --roundtrip-report - while converting, decode each output pixel back to a direction and strength
+                         and compare it against the input. Writes <inputfile>.[postfix].error.png
+                         (red: angular error in 0.1 degree steps, green: strength error in 1/255
+                         steps scaled by 16) and <inputfile>.[postfix].roundtrip.json with the
+                         mean, p99, max and PSNR of the error.
+
+Batch options, for several <inputfile>s:
+    --scheduler <name>    - how the files are spread over the cores
+                            pipeline - decode, convert and encode stages joined by queues (default)
+                            steal    - a work stealing pool; each file is loaded, split into tiles
+                                       of rows in proportion to its size for conversion, then written
+    --threads <n>         - workers in the work stealing pool (default: all cores)
+    --io <name>           - how files are read and written
+                            stdio   - stb_image reads and writes the files itself (default)
+                            threads - whole files are read into and written from memory by
+                                      dedicated I/O threads, overlapping with conversion
+                            uring   - as threads, but submitted through io_uring on Linux;
+                                      falls back to threads where io_uring is unavailable
+    --decode-threads <n>  - threads decoding input files (default: a quarter of the cores)
+    --convert-threads <n> - threads converting decoded images, one image each at a time
+                            (default: a quarter of the cores)
+    --encode-threads <n>  - threads encoding outputs (default: half of the cores)
+    --queue-depth <n>     - images held between two stages before the earlier one waits (default 4)
+    --watch               - convert the inputs, then keep watching them and reconvert each one whose
+                            contents change, until interrupted. An <inputfile> may also be a
+                            directory, whose images (other than this tool's outputs) are all
+                            watched. Changes are collected until the files have been quiet for
+                            150 ms and files saved with unchanged contents are skipped. The
+                            worker threads stay up between changes. Linux only (inotify).
+    --processes <n>       - shard the files over <n> worker processes instead, handed out one at a
+                            time over local sockets by this process, which coordinates. A file
+                            whose worker dies is requeued on a replacement worker, up to 3 times,
+                            and the workers' timings are merged into one report. Unix only.
+    --numa                - use the work stealing pool with its workers split into groups pinned to
+                            each NUMA node (read from /sys/devices/system/node). Files are dealt
+                            to the nodes in turn and converted by that node's workers, so their
+                            buffers are allocated on it; workers steal from other nodes only
+                            when theirs has run dry. Reports the throughput of each node.
+
+Analysis:
+    analyze <reportfile> [<inputfile> <inputtype>] [options]
+        Round trips 3channel inputs through the 2D encoding (new3_to_mag2d then mag2d_to_new3)
+        and reports the angular and strength error distributions, maxima and histograms.
+        Without an <inputfile> all 2^24 possible 3channel inputs are swept; otherwise only the
+        distinct inputs present in the texture are. <reportfile> is written as CSV when it
+        ends in .csv and as JSON otherwise.
+
+Rendering:
+    render <outputfile> <inputfile> <inputtype> [<inputfile2> <inputtype2>] [options]
+        Renders the anisotropy texture on a plane or sphere lit by a point light, using the
+        anisotropic GGX specular BRDF described in the README, and writes <outputfile> as PNG.
+        With a second input both are rendered side by side and the image space difference is
+        written to <outputfile>.diff.png (scaled by 8) with its RMSE, PSNR and max reported.
+    --shape <plane|sphere> - surface the texture is mapped onto (default plane)
+    --size <pixels>        - width and height of each rendering (default 512)
+    --roughness <value>    - perceptual roughness of the surface (default 0.4)
+    --max-rmse <value>     - exit with an error when the RMSE between the two renderings, in
+                             8-bit steps, exceeds <value>
+
+glTF scenes:
+    gltf <scene.gltf> [<inputtype>] <outputtype> [options]
+        Converts every anisotropyTexture referenced through KHR_materials_anisotropy in the
+        scene, in the encoding given by <inputtype> (default 3channel, as the extension
+        specifies). Images shared by several materials are converted once, all of them in
+        parallel using the batch options, and <scene>.<outputtype>.gltf is written with its
+        anisotropy textures pointing at the outputs. Images also used by other texture slots
+        keep their original and get a new image and texture for the converted copy. Output
+        location options apply; -o names the rewritten scene. Embedded images (data: URIs and
+        bufferViews) are left unconverted.
+
+Texture arrays and atlases:
+    array <outputfile> <inputfile>... <inputtype> <outputtype> [options]
+        Converts the inputs in parallel on the work stealing pool and writes them into one
+        container, chosen by the extension of <outputfile>:
+        .ktx2 - a KTX2 2D array texture, R8G8_UNORM for 2D and angle, R8G8B8_UNORM for 3channel
+        .dds  - a DDS (DX10 header) 2D texture array, R8G8_UNORM for 2D and angle,
+                R8G8B8A8_UNORM for 3channel
+        .png  - an atlas with the inputs shelf packed, --padding pixels apart
+        Array layers have the size of the largest input; smaller inputs are padded by repeating
+        their last row and column. --mips adds a mip chain to arrays. <outputfile>.json lists
+        the layer or atlas rectangle (in pixels and UVs) of every input.
+    --padding <pixels> - gutter around each atlas entry, filled from its edges (default 2)
+
+Job manifests:
+    manifest <jobfile> [<resultfile>] [options]
+        Runs every conversion listed in <jobfile> in one process, sharing the worker threads and
+        image buffers; an input listed with several output types is decoded once. Relative paths
+        are taken from the current directory and the options given here are the defaults of
+        every entry. <jobfile> is either JSON:
+            { "jobs": [ { "input": "a.png", "inputType": "3channel", "outputTypes": ["2D", "angle"],
+                          "options": { "format": "raw", "mips": true } } ] }
+        where inputType defaults to 3channel and options take the names of the options above
+        without dashes, with true for those that take no value; or one entry per line:
+            <inputfile> <inputtype> <outputtype>[,<outputtype>...] [--<option> [<value>]]...
+        with # starting a comment and double quotes around paths containing spaces.
+        <resultfile> (default <jobfile>.results.json) lists for every conversion whether it
+        succeeded, its decode, convert and write times, and the size and 64-bit FNV-1a hash of
+        each file written.
+
+Benchmarking:
+    benchmark <inputfile> <inputtype> <outputtype> [options]
+        Loads <inputfile> once and times the conversion in memory with each --huge-pages mode,
+        reporting the first (page faulting) run, the best and mean of the rest in Mpixel/s, and
+        how much memory transparent huge pages back.
+        Conversion options apply; outputs are not written.
+    --repeat <n> - conversions timed per mode (default 5)
+    --scale <n>  - tile the input n x n times first, e.g. 8 turns a 2k texture into 16k
 )";
 }
 
@@ -134,6 +705,12 @@ uint8_t angleToUNorm(float theta)
     return std::clamp<uint8_t>(uint8_t(v * 255.f), 0, 255);
 }
 
+uint8_t directionToAngle(float dirx, float diry)
+{
+    normalize(dirx, diry);
+    return angleToUNorm(toDirectionAngle(dirx, diry));
+}
+
 std::pair<float, float> bakeStrength(unsigned char x, unsigned char y, unsigned char strength)
 {
     float dirx = float(x);
@@ -150,340 +727,7056 @@ std::pair<float, float> bakeStrength(unsigned char x, unsigned char y, unsigned
     return { dirx, diry };
 }
 
-std::string stripExt(const std::string& filename)
+std::pair<uint8_t, uint8_t> encodeMag2D(uint8_t x, uint8_t y, uint8_t strength)
 {
-    size_t pos = filename.find_last_of('.');
-    return filename.substr(0, pos);
+    // reduce from x,y direction + strength (3 channels) to
+    // an x,y direction with a magnitude representing strength
+    auto [fdirx, fdiry] = bakeStrength(x, y, strength);
+    return { uint8_t(fdirx * 255.f), uint8_t(fdiry * 255.f) };
 }
 
-int main(int argc, char** argv)
+void decodeMag2D(uint8_t x, uint8_t y, uint8_t& dirx, uint8_t& diry, uint8_t& strength)
 {
-    if (argc != 4)
-    {
-        std::cout << usage();
-        return 0;
-    }
+    float fdirx = float(x);
+    float fdiry = float(y);
+    toVecSpace(fdirx, fdiry);
 
-    std::string filename = argv[1];
-    std::string inputtype = argv[2];
-    std::string outputtype = argv[3];
+    float fstrength = std::min(sqrt(fdirx * fdirx + fdiry * fdiry), 1.f);
+    normalize(fdirx, fdiry);
 
-    std::unordered_map<std::string, Type> typeMapping = {
-        {"3channel2", Type::eOld3Channel},
-        {"3channel", Type::e3Channel},
-        {"2D", Type::e2D},
-        {"angle", Type::eAngle}
-    };
+    toTexSpace(fdirx, fdiry);
 
-    if (typeMapping.find(inputtype) == typeMapping.end() || typeMapping.find(outputtype) == typeMapping.end())
+    dirx = uint8_t(fdirx * 255.f);
+    diry = uint8_t(fdiry * 255.f);
+    strength = uint8_t(fstrength * 255.f);
+}
+
+// Structure-of-arrays forms of encodeMag2D/decodeMag2D. The loops are branch free so the
+// compiler can vectorize them, and perform the same float operations in the same order so
+// the results match the per-pixel kernels bit for bit.
+void encodeMag2DBatch(const uint8_t* x, const uint8_t* y, const uint8_t* strength, uint8_t* outx, uint8_t* outy, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
     {
-        std::cout << usage();
-        return 0;
+        float dirx = (float(x[i]) / 255.f - 0.5f) * 2.f;
+        float diry = (float(y[i]) / 255.f - 0.5f) * 2.f;
+        float magnitude = sqrtf(dirx * dirx + diry * diry);
+        magnitude = magnitude > 0.f ? magnitude : 1.f;
+        dirx = dirx / magnitude * (float(strength[i]) / 255.f);
+        diry = diry / magnitude * (float(strength[i]) / 255.f);
+        dirx = std::min((dirx + 1.f) * 0.5f, 1.f);
+        diry = std::min((diry + 1.f) * 0.5f, 1.f);
+        outx[i] = uint8_t(int(dirx * 255.f));
+        outy[i] = uint8_t(int(diry * 255.f));
     }
+}
 
-    Type outtype = typeMapping[outputtype];
+void decodeMag2DBatch(const uint8_t* x, const uint8_t* y, uint8_t* outx, uint8_t* outy, uint8_t* outStrength, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        float dirx = (float(x[i]) / 255.f - 0.5f) * 2.f;
+        float diry = (float(y[i]) / 255.f - 0.5f) * 2.f;
+        float magnitude = sqrtf(dirx * dirx + diry * diry);
+        float strength = std::min(magnitude, 1.f);
+        magnitude = magnitude > 0.f ? magnitude : 1.f;
+        dirx = std::min((dirx / magnitude + 1.f) * 0.5f, 1.f);
+        diry = std::min((diry / magnitude + 1.f) * 0.5f, 1.f);
+        outx[i] = uint8_t(int(dirx * 255.f));
+        outy[i] = uint8_t(int(diry * 255.f));
+        outStrength[i] = uint8_t(int(strength * 255.f));
+    }
+}
 
-    AnisotropyData loaded = loadData(filename, typeMapping[inputtype]);
-    AnisotropyData transformed;
+// Decoded direction angle and strength of every 2D code, bucketed into a polar grid so
+// the code closest to a given direction and strength can be found by searching
+// outwards from its cell instead of testing all 65536 codes.
+struct InverseMag2DGrid
+{
+    static constexpr int angleCells = 256;
+    static constexpr int strengthCells = 64;
+    static constexpr float angleCellSize = 2.f * std::numbers::pi_v<float> / angleCells;
+    static constexpr float strengthCellSize = 1.f / strengthCells;
 
-    if (loaded.type == Type::eOld3Channel)
+    // codes sorted by cell; cell i holds entries [cellStart[i], cellStart[i + 1])
+    std::vector<uint32_t> cellStart;
+    std::vector<uint16_t> codes;
+    std::vector<float> angles;
+    std::vector<float> strengths;
+    // direction is meaningless without any anisotropy strength, so zero strength inputs
+    // all map to the code with the weakest decoded strength
+    uint16_t zeroStrengthCode = 0;
+
+    static int angleCell(float theta)
     {
-        loaded = old3_to_new3(loaded);
+        return std::min(int(theta / angleCellSize), angleCells - 1);
     }
-    else if (loaded.type == Type::eAngle)
+
+    static int strengthCell(float strength)
     {
-        loaded = angle_to_new3(loaded);
+        return std::min(int(strength / strengthCellSize), strengthCells - 1);
     }
+};
 
-    if (loaded.type == Type::e3Channel)
-    {
-        if (outtype == Type::e2D)
+float decodedAngle(uint8_t x, uint8_t y)
+{
+    float dirx = float(x);
+    float diry = float(y);
+    toVecSpace(dirx, diry);
+    normalize(dirx, diry);
+    return toDirectionAngle(dirx, diry);
+}
+
+const InverseMag2DGrid& inverseMag2DGrid()
+{
+    static const InverseMag2DGrid grid = []() {
+        // error is measured after decoding with decodeMag2D, as the round trip reports do
+        std::vector<float> angles(65536);
+        std::vector<float> strengths(65536);
+        std::vector<int> cells(65536);
+        std::vector<uint32_t> cellCounts(InverseMag2DGrid::angleCells * InverseMag2DGrid::strengthCells + 1, 0);
+        for (uint32_t code = 0; code < 65536; ++code)
         {
-            transformed = new3_to_mag2d(loaded);
+            uint8_t dirx, diry, strength;
+            decodeMag2D(uint8_t(code >> 8), uint8_t(code), dirx, diry, strength);
+            angles[code] = decodedAngle(dirx, diry);
+            strengths[code] = strength / 255.f;
+            cells[code] = InverseMag2DGrid::angleCell(angles[code]) * InverseMag2DGrid::strengthCells + InverseMag2DGrid::strengthCell(strengths[code]);
+            ++cellCounts[cells[code] + 1];
         }
-        else if (outtype == Type::eAngle)
+
+        InverseMag2DGrid result;
+        result.cellStart.resize(cellCounts.size());
+        for (size_t i = 1; i < cellCounts.size(); ++i)
         {
-            transformed = new3_to_angle(loaded);
+            result.cellStart[i] = result.cellStart[i - 1] + cellCounts[i];
         }
-        else if (outtype == Type::e3Channel)
+        result.codes.resize(65536);
+        result.angles.resize(65536);
+        result.strengths.resize(65536);
+        std::vector<uint32_t> next(result.cellStart.begin(), result.cellStart.end() - 1);
+        for (uint32_t code = 0; code < 65536; ++code)
         {
-            transformed = loaded;
+            uint32_t index = next[cells[code]]++;
+            result.codes[index] = uint16_t(code);
+            result.angles[index] = angles[code];
+            result.strengths[index] = strengths[code];
+            if (strengths[code] < strengths[result.zeroStrengthCode])
+            {
+                result.zeroStrengthCode = uint16_t(code);
+            }
         }
+        return result;
+    }();
+    return grid;
+}
+
+std::pair<uint8_t, uint8_t> encodeMag2DOptimal(uint8_t x, uint8_t y, uint8_t strength)
+{
+    const InverseMag2DGrid& grid = inverseMag2DGrid();
+    constexpr float twopi = 2.f * std::numbers::pi_v<float>;
+
+    if (strength == 0)
+    {
+        return { uint8_t(grid.zeroStrengthCode >> 8), uint8_t(grid.zeroStrengthCode) };
     }
 
-    if (loaded.type == Type::e2D)
+    float theta = decodedAngle(x, y);
+    float target = strength / 255.f;
+
+    int angleCell = InverseMag2DGrid::angleCell(theta);
+    int strengthCell = InverseMag2DGrid::strengthCell(target);
+
+    float bestCost = std::numeric_limits<float>::max();
+    uint16_t bestCode = 0;
+    for (int ring = 0; ring < InverseMag2DGrid::angleCells; ++ring)
     {
-        if (outtype == Type::eAngle)
+        // every cell in this ring is at least ring - 1 whole cells away in angle or strength
+        float reach = float(std::max(ring - 1, 0));
+        float angleBound = reach * InverseMag2DGrid::angleCellSize;
+        float strengthBound = reach * InverseMag2DGrid::strengthCellSize;
+        float bound = std::min(angleBound * angleBound, strengthBound * strengthBound);
+        if (bound >= bestCost)
         {
-            transformed = mag2d_to_angle(loaded);
+            break;
         }
-        else if (outtype == Type::e3Channel)
+
+        for (int da = -ring; da <= ring; ++da)
         {
-            transformed = mag2d_to_new3(loaded);
+            for (int ds = -ring; ds <= ring; ++ds)
+            {
+                if (std::max(std::abs(da), std::abs(ds)) != ring)
+                {
+                    continue;
+                }
+                int cellS = strengthCell + ds;
+                if (cellS < 0 || cellS >= InverseMag2DGrid::strengthCells || 2 * std::abs(da) > InverseMag2DGrid::angleCells)
+                {
+                    continue;
+                }
+                int cellA = (angleCell + da + InverseMag2DGrid::angleCells) % InverseMag2DGrid::angleCells;
+                int cell = cellA * InverseMag2DGrid::strengthCells + cellS;
+                for (uint32_t i = grid.cellStart[cell]; i < grid.cellStart[cell + 1]; ++i)
+                {
+                    float angleError = std::abs(grid.angles[i] - theta);
+                    angleError = std::min(angleError, twopi - angleError);
+                    float strengthError = grid.strengths[i] - target;
+                    float cost = angleError * angleError + strengthError * strengthError;
+                    if (cost < bestCost)
+                    {
+                        bestCost = cost;
+                        bestCode = grid.codes[i];
+                    }
+                }
+            }
         }
     }
 
-    if (transformed.data.empty())
-    {
-        std::cout << "Unsupported conversion: " << inputtype << " to " << outputtype << std::endl;
-        return 0;
-    }
-
-    writeData(filename, transformed);
-
-
-    return 0;
+    return { uint8_t(bestCode >> 8), uint8_t(bestCode) };
 }
 
-AnisotropyData loadData(const std::string& filename, Type anisotropyType)
-{
-    //int numChannels = (anisotropyType == Type::e2D || anisotropyType == Type::eAngle) ? 2 : 3;
-    int numChannels = 3;
-
-    int w, h, n;
-    unsigned char* input = stbi_load(filename.c_str(), &w, &h, &n, numChannels);
-
-    assert(n == numChannels);
-    std::vector<uint8_t> result(w * h * numChannels);
-    memcpy(result.data(), input, result.size());
+// Set on the workers of a WorkStealingPool and the stage threads of the pipeline, whose
+// tasks already keep every core busy
+inline thread_local bool onPoolWorker = false;
 
-    stbi_image_free(input);
-
-    return { .data = result, .width = w, .height = h, .numChannels = numChannels, .type = anisotropyType };
+size_t parallelChunks()
+{
+    return std::max(1u, std::thread::hardware_concurrency());
 }
 
-AnisotropyData old3_to_new3(const AnisotropyData& old3channel)
+// Splits [0, count) into parallelChunks() contiguous ranges and runs fn(chunk, begin, end)
+// for each of them on its own thread. On a pool worker the ranges run one after another on
+// the calling thread instead, rather than starting a thread per core for every task.
+template <typename Fn>
+void parallelFor(size_t count, Fn&& fn)
 {
-    AnisotropyData result;
-    result.width = old3channel.width;
-    result.height = old3channel.height;
-    result.numChannels = 3;
-    result.type = Type::e3Channel;
-
-    result.data.resize(result.width * result.height * result.numChannels);
-
-    size_t srcOffset = 0;
-    size_t destOffset = 0;
-    for (int y = 0; y < old3channel.height; ++y)
+    size_t numChunks = parallelChunks();
+    if (onPoolWorker)
     {
-        for (int x = 0; x < old3channel.width; ++x)
+        for (size_t chunk = 0; chunk < numChunks; ++chunk)
         {
-            uint8_t dirx = old3channel.data[srcOffset];
-            uint8_t diry = old3channel.data[srcOffset + 1];
-            uint8_t str = old3channel.data[srcOffset + 2];
-            srcOffset += old3channel.numChannels;
-
-            if (str < 128)
-            {
-                std::swap(dirx, diry);
-                str = 128 - str;
-            }
-            else
-            {
-                str = str - 128;
-            }
-            str = uint8_t(255.0 * str / 128.0);
-
-            result.data[destOffset] = dirx;
-            result.data[destOffset + 1] = diry;
-            result.data[destOffset + 2] = str;
-            destOffset += result.numChannels;
+            fn(chunk, count * chunk / numChunks, count * (chunk + 1) / numChunks);
         }
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (size_t chunk = 0; chunk < numChunks; ++chunk)
+    {
+        size_t begin = count * chunk / numChunks;
+        size_t end = count * (chunk + 1) / numChunks;
+        threads.emplace_back([&fn, chunk, begin, end]() { fn(chunk, begin, end); });
+    }
+    for (std::thread& thread : threads)
+    {
+        thread.join();
     }
-
-    return result;
 }
 
-AnisotropyData angle_to_new3(const AnisotropyData& input)
+struct ErrorStats
 {
-    AnisotropyData result;
-    result.width = input.width;
-    result.height = input.height;
-    result.numChannels = 3;
-    result.type = Type::e2D;
+    // angular error histogram in 0.1 degree bins, strength error histogram in 1/255 steps
+    static constexpr int angleBins = 1800;
+    static constexpr float angleBinsPerDegree = 10.f;
+    static constexpr int strengthBins = 256;
 
-    result.data.resize(result.width * result.height * result.numChannels);
+    std::vector<uint64_t> angleHistogram = std::vector<uint64_t>(angleBins, 0);
+    std::vector<uint64_t> strengthHistogram = std::vector<uint64_t>(strengthBins, 0);
+    uint64_t count = 0;
+    uint64_t angleCount = 0;
+    double angleSum = 0.0;
+    double angleSqSum = 0.0;
+    double strengthSum = 0.0;
+    double strengthSqSum = 0.0;
+    float maxAngle = 0.f;
+    float maxStrength = 0.f;
+    uint32_t maxAngleInput = 0;
+    uint32_t maxStrengthInput = 0;
+    // squared error of the decoded channels in texture space, for PSNR
+    double byteSqSum = 0.0;
+    uint64_t byteCount = 0;
 
-    size_t srcOffset = 0;
-    size_t destOffset = 0;
-    for (int y = 0; y < input.height; ++y)
+    void addAngle(float degrees, uint32_t input)
     {
-        for (int x = 0; x < input.width; ++x)
+        int bin = std::min(int(degrees * angleBinsPerDegree), angleBins - 1);
+        ++angleHistogram[bin];
+        ++angleCount;
+        angleSum += degrees;
+        angleSqSum += double(degrees) * degrees;
+        if (degrees > maxAngle)
         {
-            uint8_t angle = input.data[srcOffset];
-            uint8_t str = input.data[srcOffset + 1];
-            srcOffset += input.numChannels;
+            maxAngle = degrees;
+            maxAngleInput = input;
+        }
+    }
 
-            float dirx, diry;
-            angleToDir(angle, dirx, diry);
+    void addStrength(float error, uint32_t input)
+    {
+        int bin = std::min(int(error * 255.f + 0.5f), strengthBins - 1);
+        ++strengthHistogram[bin];
+        ++count;
+        strengthSum += error;
+        strengthSqSum += double(error) * error;
+        if (error > maxStrength)
+        {
+            maxStrength = error;
+            maxStrengthInput = input;
+        }
+    }
 
-            normalize(dirx, diry);
+    void addBytes(const uint8_t* reference, const uint8_t* decoded, int numChannels)
+    {
+        for (int i = 0; i < numChannels; ++i)
+        {
+            double error = double(reference[i]) - double(decoded[i]);
+            byteSqSum += error * error;
+        }
+        byteCount += numChannels;
+    }
 
-            result.data[destOffset] = uint8_t(dirx * 255.f);
-            result.data[destOffset + 1] = uint8_t(diry * 255.f);
-            result.data[destOffset + 2] = str;
+    void merge(const ErrorStats& other)
+    {
+        for (int i = 0; i < angleBins; ++i)
+        {
+            angleHistogram[i] += other.angleHistogram[i];
+        }
+        for (int i = 0; i < strengthBins; ++i)
+        {
+            strengthHistogram[i] += other.strengthHistogram[i];
+        }
+        count += other.count;
+        angleCount += other.angleCount;
+        angleSum += other.angleSum;
+        angleSqSum += other.angleSqSum;
+        strengthSum += other.strengthSum;
+        strengthSqSum += other.strengthSqSum;
+        byteSqSum += other.byteSqSum;
+        byteCount += other.byteCount;
+        if (other.maxAngle > maxAngle)
+        {
+            maxAngle = other.maxAngle;
+            maxAngleInput = other.maxAngleInput;
+        }
+        if (other.maxStrength > maxStrength)
+        {
+            maxStrength = other.maxStrength;
+            maxStrengthInput = other.maxStrengthInput;
         }
     }
 
-    return result;
-}
+    // value of the histogram bin containing the given fraction of samples; binEdge selects
+    // the upper edge for binned ranges or 0 for bins holding exact values
+    static float percentile(const std::vector<uint64_t>& histogram, uint64_t total, double fraction, float binWidth, float binEdge)
+    {
+        uint64_t target = uint64_t(std::ceil(double(total) * fraction));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < histogram.size(); ++i)
+        {
+            seen += histogram[i];
+            if (seen >= target && seen > 0)
+            {
+                return (float(i) + binEdge) * binWidth;
+            }
+        }
+        return (float(histogram.size() - 1) + binEdge) * binWidth;
+    }
 
-AnisotropyData mag2d_to_new3(const AnisotropyData& input)
-{
-    AnisotropyData result;
-    result.width = input.width;
-    result.height = input.height;
-    result.numChannels = 3;
-    result.type = Type::e3Channel;
+    float anglePercentile(double fraction) const
+    {
+        return percentile(angleHistogram, angleCount, fraction, 1.f / angleBinsPerDegree, 1.f);
+    }
 
-    result.data.resize(result.width * result.height * result.numChannels);
+    float strengthPercentile(double fraction) const
+    {
+        return percentile(strengthHistogram, count, fraction, 1.f / 255.f, 0.f);
+    }
 
-    size_t srcOffset = 0;
-    size_t destOffset = 0;
-    for (int y = 0; y < input.height; ++y)
+    double psnr() const
     {
-        for (int x = 0; x < input.width; ++x)
+        if (byteSqSum == 0.0)
         {
-            float dirx = float(input.data[srcOffset]);
-            float diry = float(input.data[srcOffset + 1]);
-            srcOffset += input.numChannels;
+            return std::numeric_limits<double>::infinity();
+        }
+        return 10.0 * std::log10(255.0 * 255.0 * double(byteCount) / byteSqSum);
+    }
+};
 
-            toVecSpace(dirx, diry);
+// One file moving through load, convert and write
+// A converted region of an image, at x, y in the full output
+struct TilePatch
+{
+    int x = 0;
+    int y = 0;
+    AnisotropyData image;
+};
 
-            float strength = std::min(sqrt(dirx * dirx + diry * diry), 1.f);
-            normalize(dirx, diry);
+struct FileJob
+{
+    std::string filename;
+    AnisotropyData loaded;
+    AnisotropyData transformed;
+    ErrorStats stats;
+    AnisotropyData errorImage;
+    // with --levels, transformed is the first requested level and these follow it
+    std::vector<AnisotropyData> mipLevels;
+    // with --incremental, the hash of each input tile and, when the previous output is patched
+    // rather than rewritten, the tiles that changed; transformed stays empty then
+    std::vector<uint64_t> tileHashes;
+    Type hashedType = Type::e3Channel;
+    std::vector<TilePatch> patches;
+    bool patched = false;
+    // why convertJob produced nothing, when the options asked for what the input can't give;
+    // empty when the conversion itself is unsupported
+    std::string error;
+};
 
-            toTexSpace(dirx, diry);
+// Whether convertJob produced something to write
+bool hasOutput(const FileJob& job)
+{
+    return !job.transformed.data.empty() || job.patched;
+}
 
+// The message for a file of a batch that convertJob produced nothing for
+std::string conversionFailure(const FileJob& job)
+{
+    return job.error.empty() ? "Unsupported conversion for " + job.filename : job.filename + ": " + job.error;
+}
 
-            result.data[destOffset] = uint8_t(dirx * 255.f);
-            result.data[destOffset + 1] = uint8_t(diry * 255.f);
-            result.data[destOffset + 2] = uint8_t(strength * 255.f);
-            destOffset += 3;
+// Fixed capacity queue between pipeline stages; push waits while full and pop waits while
+// empty until the queue is closed.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity)
+        : capacity(capacity)
+    {
+    }
+
+    void push(T item)
+    {
+        std::unique_lock lock(mutex);
+        notFull.wait(lock, [this]() { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        maxSize = std::max(maxSize, items.size());
+        notEmpty.notify_one();
+    }
+
+    std::optional<T> pop()
+    {
+        std::unique_lock lock(mutex);
+        notEmpty.wait(lock, [this]() { return !items.empty() || closed; });
+        if (items.empty())
+        {
+            return std::nullopt;
         }
+        T item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return item;
     }
 
-    return result;
-}
+    // wakes every waiting pop once the remaining items are drained
+    void close()
+    {
+        std::lock_guard lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+    }
 
-AnisotropyData mag2d_to_angle(const AnisotropyData& input)
+    size_t highWater()
+    {
+        std::lock_guard lock(mutex);
+        return maxSize;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    std::deque<T> items;
+    size_t capacity;
+    size_t maxSize = 0;
+    bool closed = false;
+};
+
+// Free buffers bucketed by size; sizes round up to the next of 4, 5, 6 or 7 times a power of
+// two, so similar images share buckets while wasting at most a quarter of a buffer
+class BufferPool
 {
-    AnisotropyData result;
-    result.width = input.width;
-    result.height = input.height;
-    result.numChannels = 3;
-    result.type = Type::eAngle;
+public:
+    ~BufferPool()
+    {
+        trim();
+    }
 
-    result.data.resize(result.width * result.height * result.numChannels);
+    void* acquire(size_t size)
+    {
+        size = bucket(size);
+        HugePages mode;
+        {
+            std::lock_guard lock(mutex);
+            ++requests;
+            live += size;
+            auto& buffers = freeList(currentNumaNode);
+            auto it = buffers.find(size);
+            if (it != buffers.end() && !it->second.empty())
+            {
+                void* memory = it->second.back();
+                it->second.pop_back();
+                cached -= size;
+                ++hits;
+                return memory;
+            }
+            peak = std::max(peak, live + cached);
+            mode = hugePages;
+        }
+        if (mode != HugePages::eOff && size >= hugePageSize)
+        {
+            if (void* memory = allocateHuge(size, mode))
+            {
+                return memory;
+            }
+        }
+#ifdef _WIN32
+        void* memory = _aligned_malloc(size, alignment);
+#else
+        void* memory = aligned_alloc(alignment, size);
+#endif
+        if (!memory)
+        {
+            throw std::bad_alloc();
+        }
+        return memory;
+    }
 
-    size_t srcOffset = 0;
-    size_t destOffset = 0;
-    for (int y = 0; y < input.height; ++y)
+    void release(void* memory, size_t size)
     {
-        for (int x = 0; x < input.width; ++x)
+        if (!memory)
         {
-            float dirx = float(input.data[srcOffset]);
-            float diry = float(input.data[srcOffset + 1]);
-            srcOffset += input.numChannels;
-            toVecSpace(dirx, diry);
+            return;
+        }
+        size = bucket(size);
+        {
+            std::lock_guard lock(mutex);
+            live -= size;
+            if (cached + size <= maxCached)
+            {
+                freeList(currentNumaNode)[size].push_back(memory);
+                cached += size;
+                return;
+            }
+        }
+        freeAny(memory, size);
+    }
 
-            float strength = std::min(sqrt(dirx * dirx + diry * diry), 1.f);
-            normalize(dirx, diry);
+    // returns every cached buffer, so later allocations pick up a new huge page mode
+    void trim()
+    {
+        std::vector<std::unordered_map<size_t, std::vector<void*>>> buffers;
+        {
+            std::lock_guard lock(mutex);
+            buffers.swap(freeBuffers);
+            cached = 0;
+        }
+        for (auto& node : buffers)
+        {
+            for (auto& [size, memories] : node)
+            {
+                for (void* memory : memories)
+                {
+                    freeAny(memory, size);
+                }
+            }
+        }
+    }
 
-            float theta = toDirectionAngle(dirx, diry);
+    void setHugePages(HugePages mode)
+    {
+        std::lock_guard lock(mutex);
+        hugePages = mode;
+    }
 
-            result.data[destOffset] = angleToUNorm(theta);
-            result.data[destOffset + 1] = uint8_t(strength * 255.f);
-            result.data[destOffset + 2] = 0;
-            destOffset += 3;
+    void report()
+    {
+        std::lock_guard lock(mutex);
+        if (requests == 0)
+        {
+            return;
+        }
+        std::cout << std::format("Buffer pool: {0} allocations, {1:.1f}% reused, peak footprint {2:.1f} MiB", requests, 100.0 * hits / requests, peak / 1048576.0);
+        if (hugePages != HugePages::eOff || hugeAllocations[int(HugePages::eExplicit)] + hugeAllocations[int(HugePages::eTransparent)] + hugeFallbacks > 0)
+        {
+            std::cout << std::format(", huge pages: {0} explicit, {1} transparent, {2} fell back", hugeAllocations[int(HugePages::eExplicit)],
+                hugeAllocations[int(HugePages::eTransparent)], hugeFallbacks);
         }
+        std::cout << "\n";
     }
 
-    return result;
-}
+private:
+    static constexpr size_t alignment = 64;
+    // buffers beyond this are returned to the heap rather than kept for reuse
+    static constexpr size_t maxCached = size_t(1) << 30;
 
-AnisotropyData new3_to_angle(const AnisotropyData& input)
-{
-    AnisotropyData result;
-    result.width = input.width;
-    result.height = input.height;
-    result.numChannels = 3;
-    result.type = Type::eAngle;
+    static size_t bucket(size_t size)
+    {
+        size = std::max(size, alignment);
+        size_t power = alignment;
+        while (power * 2 < size)
+        {
+            power *= 2;
+        }
+        size_t step = std::max(power / 4, alignment);
+        return (size + step - 1) / step * step;
+    }
 
-    result.data.resize(result.width * result.height * result.numChannels);
+    static constexpr size_t hugePageSize = size_t(2) << 20;
 
-    size_t srcOffset = 0;
-    size_t destOffset = 0;
-    for (int y = 0; y < input.height; ++y)
+    // free buffers kept per NUMA node; a buffer goes back to the list of the node releasing it
+    std::unordered_map<size_t, std::vector<void*>>& freeList(int node)
     {
-        for (int x = 0; x < input.width; ++x)
+        if (size_t(node) >= freeBuffers.size())
         {
-            float dirx = float(input.data[srcOffset]);
-            float diry = float(input.data[srcOffset + 1]);
-            unsigned char str = input.data[srcOffset + 2];
-            srcOffset += input.numChannels;
-            toVecSpace(dirx, diry);
-            normalize(dirx, diry);
+            freeBuffers.resize(node + 1);
+        }
+        return freeBuffers[node];
+    }
 
-            float theta = toDirectionAngle(dirx, diry);
+    // an explicit MAP_HUGETLB mapping, else an anonymous mapping aligned to a huge page and
+    // advised for transparent huge pages; null when neither is available
+    void* allocateHuge(size_t size, HugePages mode)
+    {
+#ifdef ANISOTROPINATOR_MMAP
+        size_t rounded = (size + hugePageSize - 1) / hugePageSize * hugePageSize;
+#ifdef MAP_HUGETLB
+        if (mode == HugePages::eExplicit)
+        {
+            void* memory = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (memory != MAP_FAILED)
+            {
+                recordHuge(memory, HugePages::eExplicit);
+                return memory;
+            }
+            // no huge pages reserved in /proc/sys/vm/nr_hugepages
+            std::lock_guard lock(mutex);
+            ++hugeFallbacks;
+        }
+#endif
+        void* mapping = mmap(nullptr, rounded + hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping != MAP_FAILED)
+        {
+            uint8_t* start = static_cast<uint8_t*>(mapping);
+            uint8_t* aligned = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(start) + hugePageSize - 1) / hugePageSize * hugePageSize);
+            if (aligned > start)
+            {
+                munmap(start, aligned - start);
+            }
+            munmap(aligned + rounded, start + rounded + hugePageSize - aligned - rounded);
+#ifdef MADV_HUGEPAGE
+            madvise(aligned, rounded, MADV_HUGEPAGE);
+#endif
+            recordHuge(aligned, HugePages::eTransparent);
+            return aligned;
+        }
+#endif
+        std::lock_guard lock(mutex);
+        ++hugeFallbacks;
+        return nullptr;
+    }
 
-            result.data[destOffset] = angleToUNorm(theta);
-            result.data[destOffset + 1] = str;
-            result.data[destOffset + 2] = 0;
-            destOffset += 3;
+    void recordHuge(void* memory, HugePages mode)
+    {
+        std::lock_guard lock(mutex);
+        mapped[memory] = mode;
+        ++hugeAllocations[int(mode)];
+    }
+
+    void freeAny(void* memory, size_t size)
+    {
+        {
+            std::lock_guard lock(mutex);
+            auto it = mapped.find(memory);
+            if (it != mapped.end())
+            {
+                mapped.erase(it);
+#ifdef ANISOTROPINATOR_MMAP
+                munmap(memory, (size + hugePageSize - 1) / hugePageSize * hugePageSize);
+#endif
+                return;
+            }
         }
+#ifdef _WIN32
+        _aligned_free(memory);
+#else
+        free(memory);
+#endif
     }
 
-    return result;
+    std::mutex mutex;
+    HugePages hugePages = HugePages::eOff;
+    std::unordered_map<void*, HugePages> mapped;
+    std::array<uint64_t, 3> hugeAllocations = {};
+    uint64_t hugeFallbacks = 0;
+    std::vector<std::unordered_map<size_t, std::vector<void*>>> freeBuffers;
+    size_t live = 0;
+    size_t cached = 0;
+    size_t peak = 0;
+    uint64_t requests = 0;
+    uint64_t hits = 0;
+};
+
+BufferPool& bufferPool()
+{
+    static BufferPool pool;
+    return pool;
 }
 
-AnisotropyData new3_to_mag2d(const AnisotropyData& input)
+void* acquireBuffer(size_t size)
 {
-    AnisotropyData result;
-    result.width = input.width;
-    result.height = input.height;
-    result.numChannels = 3;
-    result.type = Type::e2D;
+    return bufferPool().acquire(size);
+}
 
-    result.data.resize(result.width * result.height * result.numChannels);
+void releaseBuffer(void* memory, size_t size)
+{
+    bufferPool().release(memory, size);
+}
 
-    size_t srcOffset = 0;
-    size_t destOffset = 0;
-    for (int y = 0; y < input.height; ++y)
+void reportBufferPool()
+{
+    bufferPool().report();
+}
+
+void trimBufferPool()
+{
+    bufferPool().trim();
+}
+
+void setHugePages(HugePages mode)
+{
+    bufferPool().setHugePages(mode);
+}
+
+// Nodes with CPUs, read from /sys/devices/system/node without depending on libnuma; a single
+// node with every CPU where that isn't available
+std::vector<NumaNode> numaTopology()
+{
+    std::vector<NumaNode> nodes;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", error))
     {
-        for (int x = 0; x < input.width; ++x)
+        std::string name = entry.path().filename().string();
+        if (!name.starts_with("node") || name.size() == 4 || name.find_first_not_of("0123456789", 4) != std::string::npos)
         {
-            unsigned char dirx = input.data[srcOffset];
-            unsigned char diry = input.data[srcOffset + 1];
-            unsigned char str = input.data[srcOffset + 2];
-            srcOffset += input.numChannels;
-
-            // reduce from x,y direction + strength (3 channels) to
-            // an x,y direction with a magnitude representing strength
-            auto [fdirx, fdiry] = bakeStrength(dirx, diry, str);
+            continue;
+        }
+        NumaNode node;
+        node.id = atoi(name.c_str() + 4);
 
-            result.data[destOffset] = uint8_t(fdirx * 255.f);
-            result.data[destOffset + 1] = uint8_t(fdiry * 255.f);
-            result.data[destOffset + 2] = 0;
-            destOffset += 3;
+        // a list of ranges such as 0-15,32-47
+        std::ifstream file(entry.path() / "cpulist");
+        std::string range;
+        while (std::getline(file, range, ','))
+        {
+            if (range.find_first_of("0123456789") == std::string::npos)
+            {
+                continue;
+            }
+            size_t dash = range.find('-');
+            int first = atoi(range.c_str());
+            int last = dash == std::string::npos ? first : atoi(range.c_str() + dash + 1);
+            for (int cpu = first; cpu <= last; ++cpu)
+            {
+                node.cpus.push_back(cpu);
+            }
+        }
+        // memory only nodes get no workers
+        if (!node.cpus.empty())
+        {
+            nodes.push_back(std::move(node));
         }
     }
+    std::sort(nodes.begin(), nodes.end(), [](const NumaNode& a, const NumaNode& b) { return a.id < b.id; });
 
-    return result;
+    if (nodes.empty())
+    {
+        nodes.emplace_back();
+        for (int cpu = 0; cpu < int(std::max(1u, std::thread::hardware_concurrency())); ++cpu)
+        {
+            nodes[0].cpus.push_back(cpu);
+        }
+    }
+    return nodes;
 }
 
-void writeData(const std::string& inputfilename, const AnisotropyData& transformed)
+bool pinCurrentThread(const std::vector<int>& cpus)
 {
-    std::unordered_map<Type, std::string> typeMapping = {
-        { Type::eOld3Channel, "3channel2" },
-        { Type::e3Channel, "3channel" },
-        { Type::e2D, "2D" },
-        { Type::eAngle, "angle" }
-    };
-
-    std::string outputfilename = std::format("{0}.{1}.png", stripExt(inputfilename), typeMapping[transformed.type]);
-    int result = stbi_write_png(outputfilename.c_str(), transformed.width, transformed.height, transformed.numChannels, transformed.data.data(), transformed.width * transformed.numChannels);
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+    {
+        if (cpu < CPU_SETSIZE)
+        {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
 }
 
+// Task pool where each worker owns a deque: it pushes and pops its own tasks at the back,
+// so the tasks a file spawns run while its data is hot, and idle workers steal the oldest
+// task from the front of another worker's deque. Tasks submitted from outside the pool wait
+// in a shared queue that workers only take from when there is nothing left to steal.
+// Given NUMA nodes, workers are split into consecutive groups pinned to each node's CPUs and
+// prefer tasks of their own node, stealing from other nodes only when it has none left
+class WorkStealingPool
+{
+public:
+    explicit WorkStealingPool(int numWorkers, const std::vector<NumaNode>& nodes = {})
+        : nodes(nodes), injected(std::max<size_t>(1, nodes.size()))
+    {
+        for (int i = 0; i < numWorkers; ++i)
+        {
+            workers.push_back(std::make_unique<Worker>());
+            workers[i]->random.seed(i + 1);
+            workers[i]->node = int(size_t(i) * injected.size() / numWorkers);
+        }
+        for (int i = 0; i < numWorkers; ++i)
+        {
+            workers[i]->thread = std::thread([this, i]() { run(i); });
+        }
+    }
 
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::unique_ptr<Worker>& worker : workers)
+        {
+            worker->thread.join();
+        }
+    }
 
+    // tasks submitted from outside the pool are queued for the workers of <node>, an index into
+    // the nodes the pool was created with; tasks submitted by a worker stay with that worker
+    void submit(std::function<void()> task, int node = 0)
+    {
+        ++pending;
+        if (currentPool == this)
+        {
+            Worker& worker = *workers[currentWorker];
+            std::lock_guard lock(worker.mutex);
+            worker.tasks.push_back(std::move(task));
+        }
+        else
+        {
+            std::lock_guard lock(injectMutex);
+            injected[size_t(node) % injected.size()].push_back(std::move(task));
+        }
+        {
+            std::lock_guard lock(sleepMutex);
+            ++queued;
+        }
+        wake.notify_one();
+    }
+
+    // blocks until every submitted task, and every task those spawned, has finished
+    void wait()
+    {
+        std::unique_lock lock(sleepMutex);
+        idle.wait(lock, [this]() { return pending == 0; });
+    }
+
+    uint64_t executed() const
+    {
+        uint64_t total = 0;
+        for (const std::unique_ptr<Worker>& worker : workers)
+        {
+            total += worker->executed;
+        }
+        return total;
+    }
+
+    uint64_t stolen() const
+    {
+        uint64_t total = 0;
+        for (const std::unique_ptr<Worker>& worker : workers)
+        {
+            total += worker->stolen;
+        }
+        return total;
+    }
+
+    uint64_t stolenAcrossNodes() const
+    {
+        uint64_t total = 0;
+        for (const std::unique_ptr<Worker>& worker : workers)
+        {
+            total += worker->stolenRemote;
+        }
+        return total;
+    }
+
+    int workersOnNode(int node) const
+    {
+        return int(std::count_if(workers.begin(), workers.end(), [node](const std::unique_ptr<Worker>& worker) { return worker->node == node; }));
+    }
+
+    // false when pinning failed or isn't supported, leaving the workers unpinned
+    bool pinned() const
+    {
+        return pinnedWorkers == int(workers.size());
+    }
+
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+        std::thread thread;
+        int node = 0;
+        uint64_t executed = 0;
+        uint64_t stolen = 0;
+        uint64_t stolenRemote = 0;
+        std::minstd_rand random;
+    };
+
+    bool take(int index, std::function<void()>& task)
+    {
+        Worker& self = *workers[index];
+        {
+            std::lock_guard lock(self.mutex);
+            if (!self.tasks.empty())
+            {
+                task = std::move(self.tasks.back());
+                self.tasks.pop_back();
+                return true;
+            }
+        }
+
+        // workers of the own node first, then the rest
+        for (bool local : { true, false })
+        {
+            // start at a random victim so thieves spread out
+            size_t start = std::uniform_int_distribution<size_t>(0, workers.size() - 1)(self.random);
+            for (size_t i = 0; i < workers.size(); ++i)
+            {
+                Worker& victim = *workers[(start + i) % workers.size()];
+                if (&victim == &self || (victim.node == self.node) != local)
+                {
+                    continue;
+                }
+                std::lock_guard lock(victim.mutex);
+                if (!victim.tasks.empty())
+                {
+                    task = std::move(victim.tasks.front());
+                    victim.tasks.pop_front();
+                    ++self.stolen;
+                    self.stolenRemote += local ? 0 : 1;
+                    return true;
+                }
+            }
+
+            std::lock_guard lock(injectMutex);
+            for (size_t i = 0; i < injected.size(); ++i)
+            {
+                std::deque<std::function<void()>>& queue = injected[(self.node + i) % injected.size()];
+                if ((i == 0) == local && !queue.empty())
+                {
+                    task = std::move(queue.front());
+                    queue.pop_front();
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void run(int index)
+    {
+        currentPool = this;
+        currentWorker = index;
+        onPoolWorker = true;
+        if (!nodes.empty())
+        {
+            int node = workers[index]->node;
+            currentNumaNode = node;
+            if (pinCurrentThread(nodes[node].cpus))
+            {
+                ++pinnedWorkers;
+            }
+        }
+        std::function<void()> task;
+        while (true)
+        {
+            {
+                std::unique_lock lock(sleepMutex);
+                wake.wait(lock, [this]() { return queued > 0 || stopping; });
+                if (queued == 0 && stopping)
+                {
+                    return;
+                }
+            }
+
+            if (!take(index, task))
+            {
+                // another worker got there first
+                std::this_thread::yield();
+                continue;
+            }
+            {
+                std::lock_guard lock(sleepMutex);
+                --queued;
+            }
+
+            task();
+            task = nullptr;
+            ++workers[index]->executed;
+
+            std::lock_guard lock(sleepMutex);
+            if (--pending == 0)
+            {
+                idle.notify_all();
+            }
+        }
+    }
+
+    std::vector<NumaNode> nodes;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<int> pinnedWorkers = 0;
+    std::mutex injectMutex;
+    // one queue per node
+    std::vector<std::deque<std::function<void()>>> injected;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::atomic<int64_t> pending = 0;
+    int64_t queued = 0;
+    bool stopping = false;
+
+    static inline thread_local WorkStealingPool* currentPool = nullptr;
+    static inline thread_local int currentWorker = -1;
+};
+
+// Read-only mapping of a whole file; data() is null when the file can't be mapped and the
+// caller should fall back to reading it
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& filename)
+    {
+#ifdef ANISOTROPINATOR_MMAP
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            void* mapping = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED)
+            {
+                bytes = static_cast<const uint8_t*>(mapping);
+                length = size_t(info.st_size);
+                // decoders walk the file front to back exactly once
+                madvise(mapping, length, MADV_SEQUENTIAL);
+                madvise(mapping, length, MADV_WILLNEED);
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifdef ANISOTROPINATOR_MMAP
+        if (bytes)
+        {
+            munmap(const_cast<uint8_t*>(bytes), length);
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const
+    {
+        return bytes;
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+private:
+    const uint8_t* bytes = nullptr;
+    size_t length = 0;
+};
+
+// Whole-file reads and writes completed off the calling thread, so waiting on the disk
+// overlaps with decoding and converting other files. Completion callbacks run on an I/O
+// thread and should only hand the result on.
+class AsyncFileIO
+{
+public:
+    using ReadDone = std::function<void(std::vector<uint8_t>&& bytes, bool ok)>;
+    using WriteDone = std::function<void(bool ok)>;
+
+    explicit AsyncFileIO(IOBackend backend, int numThreads = 4)
+    {
+#ifdef ANISOTROPINATOR_IO_URING
+        if (backend == IOBackend::eUring && setupRing())
+        {
+            usingRing = true;
+            threads.emplace_back([this]() { runRing(); });
+            return;
+        }
+#endif
+        for (int i = 0; i < numThreads; ++i)
+        {
+            threads.emplace_back([this]() { runBlocking(); });
+        }
+    }
+
+    ~AsyncFileIO()
+    {
+        drain();
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+#ifdef ANISOTROPINATOR_IO_URING
+        if (usingRing)
+        {
+            munmap(sqRing, sqRingSize);
+            if (cqRing != sqRing)
+            {
+                munmap(cqRing, cqRingSize);
+            }
+            munmap(sqes, sqesSize);
+            close(ringFd);
+        }
+#endif
+    }
+
+    void read(std::string path, ReadDone done)
+    {
+        enqueue(std::make_unique<Request>(Request{ .path = std::move(path), .readDone = std::move(done) }));
+    }
+
+    void write(std::string path, std::vector<uint8_t> bytes, WriteDone done)
+    {
+        enqueue(std::make_unique<Request>(Request{ .path = std::move(path), .buffer = std::move(bytes), .write = true, .writeDone = std::move(done) }));
+    }
+
+    // blocks until every read and write issued so far has completed
+    void drain()
+    {
+        std::unique_lock lock(mutex);
+        idle.wait(lock, [this]() { return outstanding == 0; });
+    }
+
+    const char* backendName() const
+    {
+        return usingRing ? "io_uring" : "threads";
+    }
+
+private:
+    struct Request
+    {
+        std::string path;
+        std::vector<uint8_t> buffer;
+        bool write = false;
+        ReadDone readDone;
+        WriteDone writeDone;
+        int fd = -1;
+        size_t done = 0;
+    };
+
+    void enqueue(std::unique_ptr<Request> request)
+    {
+        {
+            std::lock_guard lock(mutex);
+            ++outstanding;
+            requests.push_back(std::move(request));
+        }
+        wake.notify_one();
+    }
+
+    void complete(std::unique_ptr<Request> request, bool ok)
+    {
+        if (!ok)
+        {
+            std::cout << "Failed to " << (request->write ? "write " : "read ") << request->path << std::endl;
+        }
+        if (request->write)
+        {
+            if (request->writeDone)
+            {
+                request->writeDone(ok);
+            }
+        }
+        else if (request->readDone)
+        {
+            request->readDone(std::move(request->buffer), ok);
+        }
+
+        std::lock_guard lock(mutex);
+        if (--outstanding == 0)
+        {
+            idle.notify_all();
+        }
+    }
+
+    void runBlocking()
+    {
+        while (true)
+        {
+            std::unique_ptr<Request> request;
+            {
+                std::unique_lock lock(mutex);
+                wake.wait(lock, [this]() { return !requests.empty() || stopping; });
+                if (requests.empty())
+                {
+                    return;
+                }
+                request = std::move(requests.front());
+                requests.pop_front();
+            }
+
+            bool ok;
+            if (request->write)
+            {
+                std::ofstream file(request->path, std::ios::binary);
+                file.write(reinterpret_cast<const char*>(request->buffer.data()), request->buffer.size());
+                ok = bool(file);
+            }
+            else
+            {
+                std::ifstream file(request->path, std::ios::binary | std::ios::ate);
+                ok = bool(file);
+                if (ok)
+                {
+                    request->buffer.resize(size_t(file.tellg()));
+                    file.seekg(0);
+                    file.read(reinterpret_cast<char*>(request->buffer.data()), request->buffer.size());
+                    ok = bool(file);
+                }
+            }
+            complete(std::move(request), ok);
+        }
+    }
+
+#ifdef ANISOTROPINATOR_IO_URING
+    static constexpr unsigned ringEntries = 64;
+    // reads and writes larger than this are split across several submissions
+    static constexpr size_t maxTransfer = size_t(1) << 30;
+
+    bool setupRing()
+    {
+        io_uring_params params = {};
+        ringFd = int(syscall(__NR_io_uring_setup, ringEntries, &params));
+        if (ringFd < 0)
+        {
+            return false;
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap)
+        {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        cqRing = singleMmap ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
+        {
+            close(ringFd);
+            return false;
+        }
+
+        auto* sq = static_cast<uint8_t*>(sqRing);
+        auto* cq = static_cast<uint8_t*>(cqRing);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        sqEntries = params.sq_entries;
+        return true;
+    }
+
+    // queues the next chunk of a request; the I/O thread is the ring's only submitter
+    void prepare(Request* request)
+    {
+        unsigned tail = *sqTail;
+        unsigned index = tail & sqMask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        size_t length = std::min(request->buffer.size() - request->done, maxTransfer);
+        sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = request->fd;
+        sqe->off = request->done;
+        sqe->addr = reinterpret_cast<uint64_t>(request->buffer.data() + request->done);
+        sqe->len = unsigned(length);
+        sqe->user_data = reinterpret_cast<uint64_t>(request);
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++toSubmit;
+        ++inFlight;
+    }
+
+    // opens the file and sizes the buffer; false if there is nothing to submit
+    bool open(Request* request)
+    {
+        if (request->write)
+        {
+            request->fd = ::open(request->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            return request->fd >= 0 && !request->buffer.empty();
+        }
+
+        request->fd = ::open(request->path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info;
+        if (request->fd < 0 || fstat(request->fd, &info) != 0)
+        {
+            return false;
+        }
+        request->buffer.resize(size_t(info.st_size));
+        return !request->buffer.empty();
+    }
+
+    void finish(Request* request, bool ok)
+    {
+        if (request->fd >= 0)
+        {
+            close(request->fd);
+        }
+        complete(std::unique_ptr<Request>(request), ok);
+    }
+
+    void runRing()
+    {
+        while (true)
+        {
+            // start new requests while there is room in the submission queue
+            std::deque<std::unique_ptr<Request>> starting;
+            {
+                std::unique_lock lock(mutex);
+                if (inFlight == 0)
+                {
+                    wake.wait(lock, [this]() { return !requests.empty() || stopping; });
+                    if (requests.empty())
+                    {
+                        return;
+                    }
+                }
+                while (!requests.empty() && inFlight + starting.size() < sqEntries)
+                {
+                    starting.push_back(std::move(requests.front()));
+                    requests.pop_front();
+                }
+            }
+            for (std::unique_ptr<Request>& request : starting)
+            {
+                Request* raw = request.release();
+                if (open(raw))
+                {
+                    prepare(raw);
+                }
+                else
+                {
+                    // a failed open, or an empty file which has nothing to transfer
+                    finish(raw, raw->fd >= 0);
+                }
+            }
+
+            if (inFlight == 0)
+            {
+                continue;
+            }
+
+            // submit everything queued and wait for at least one completion
+            int submitted = int(syscall(__NR_io_uring_enter, ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+            if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                std::cout << "io_uring_enter failed: " << strerror(errno) << std::endl;
+            }
+            if (submitted > 0)
+            {
+                toSubmit -= unsigned(submitted);
+            }
+
+            unsigned head = *cqHead;
+            while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+            {
+                io_uring_cqe& cqe = cqes[head & cqMask];
+                Request* request = reinterpret_cast<Request*>(cqe.user_data);
+                int result = cqe.res;
+                ++head;
+                --inFlight;
+
+                if (result == -EINVAL || result == -EOPNOTSUPP)
+                {
+                    // kernels before 5.6 lack IORING_OP_READ/WRITE; finish with plain syscalls
+                    while (request->done < request->buffer.size())
+                    {
+                        ssize_t n = request->write
+                            ? pwrite(request->fd, request->buffer.data() + request->done, request->buffer.size() - request->done, off_t(request->done))
+                            : pread(request->fd, request->buffer.data() + request->done, request->buffer.size() - request->done, off_t(request->done));
+                        if (n <= 0)
+                        {
+                            break;
+                        }
+                        request->done += size_t(n);
+                    }
+                    finish(request, request->done == request->buffer.size());
+                }
+                else if (result <= 0)
+                {
+                    finish(request, false);
+                }
+                else
+                {
+                    request->done += size_t(result);
+                    if (request->done < request->buffer.size())
+                    {
+                        // short transfer, continue from where it stopped
+                        prepare(request);
+                    }
+                    else
+                    {
+                        finish(request, true);
+                    }
+                }
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        }
+    }
+
+    int ringFd = -1;
+    void* sqRing = nullptr;
+    void* cqRing = nullptr;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqesSize = 0;
+    unsigned* sqTail = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+    unsigned toSubmit = 0;
+    size_t inFlight = 0;
+#endif
+
+    bool usingRing = false;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::deque<std::unique_ptr<Request>> requests;
+    std::vector<std::thread> threads;
+    size_t outstanding = 0;
+    bool stopping = false;
+};
+
+std::string stripExt(const std::string& filename)
+{
+    // a dot in a directory name is not an extension
+    size_t pos = filename.find_last_of('.');
+    size_t separator = filename.find_last_of("/\\");
+    if (pos == std::string::npos || (separator != std::string::npos && pos < separator))
+    {
+        return filename;
+    }
+    return filename.substr(0, pos);
+}
+
+int main(int argc, char** argv)
+{
+    std::unordered_map<std::string, Type> typeMapping = {
+        {"3channel2", Type::eOld3Channel},
+        {"3channel", Type::e3Channel},
+        {"2D", Type::e2D},
+        {"angle", Type::eAngle}
+    };
+
+    ConversionOptions options;
+    RenderOptions renderOptions;
+    ArrayOptions arrayOptions;
+    BenchmarkOptions benchmarkOptions;
+    PipelineOptions pipelineOptions;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        if (arg == "--roundtrip-report")
+        {
+            options.roundtripReport = true;
+        }
+        else if (arg == "--encoder" && i + 1 < argc && std::string_view(argv[i + 1]) == "truncate")
+        {
+            options.encoder = Encoder::eTruncate;
+            ++i;
+        }
+        else if (arg == "--encoder" && i + 1 < argc && std::string_view(argv[i + 1]) == "optimal")
+        {
+            options.encoder = Encoder::eOptimal;
+            ++i;
+        }
+        else if (arg == "--dither" && i + 1 < argc && std::string_view(argv[i + 1]) == "ordered")
+        {
+            options.dither = Dither::eOrdered;
+            ++i;
+        }
+        else if (arg == "--dither" && i + 1 < argc && std::string_view(argv[i + 1]) == "diffusion")
+        {
+            options.dither = Dither::eDiffusion;
+            ++i;
+        }
+        else if (arg == "--layout" && i + 1 < argc && std::string_view(argv[i + 1]) == "planar")
+        {
+            options.layout = Layout::ePlanar;
+            ++i;
+        }
+        else if (arg == "--layout" && i + 1 < argc && std::string_view(argv[i + 1]) == "interleaved")
+        {
+            options.layout = Layout::eInterleaved;
+            ++i;
+        }
+        else if (arg == "--format" && i + 1 < argc && std::string_view(argv[i + 1]) == "png")
+        {
+            options.format = OutputFormat::ePng;
+            ++i;
+        }
+        else if (arg == "--format" && i + 1 < argc && std::string_view(argv[i + 1]) == "raw")
+        {
+            options.format = OutputFormat::eRaw;
+            ++i;
+        }
+        else if (arg == "-o" && i + 1 < argc)
+        {
+            options.outputFile = argv[++i];
+        }
+        else if (arg == "--output-root" && i + 1 < argc)
+        {
+            options.outputRoot = argv[++i];
+        }
+        else if (arg == "--input-root" && i + 1 < argc)
+        {
+            options.inputRoot = argv[++i];
+        }
+        else if (arg == "--pack" && i + 1 < argc)
+        {
+            options.packChannels = argv[++i];
+        }
+        else if (arg == "--pack-input" && i + 1 < argc)
+        {
+            // <c>=<file>[:<sourcechannel>], where a trailing :r/:g/:b/:a picks the source channel
+            std::string spec = argv[++i];
+            auto channelIndex = [](char c) { return int(std::string_view("rgba").find(c)); };
+            PackInput input;
+            input.channel = spec.size() > 2 && spec[1] == '=' ? channelIndex(spec[0]) : -1;
+            input.filename = spec.size() > 2 ? spec.substr(2) : "";
+            if (input.filename.size() > 2 && input.filename[input.filename.size() - 2] == ':' && channelIndex(input.filename.back()) >= 0)
+            {
+                input.sourceChannel = channelIndex(input.filename.back());
+                input.filename.resize(input.filename.size() - 2);
+            }
+            if (input.channel < 0 || input.filename.empty())
+            {
+                std::cout << usage();
+                return 0;
+            }
+            options.packInputs.push_back(input);
+        }
+        else if (arg == "--padding" && i + 1 < argc)
+        {
+            arrayOptions.padding = std::max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--huge-pages" && i + 1 < argc && std::string_view(argv[i + 1]) == "off")
+        {
+            setHugePages(HugePages::eOff);
+            ++i;
+        }
+        else if (arg == "--huge-pages" && i + 1 < argc && std::string_view(argv[i + 1]) == "thp")
+        {
+            setHugePages(HugePages::eTransparent);
+            ++i;
+        }
+        else if (arg == "--huge-pages" && i + 1 < argc && std::string_view(argv[i + 1]) == "explicit")
+        {
+            setHugePages(HugePages::eExplicit);
+            ++i;
+        }
+        else if (arg == "--repeat" && i + 1 < argc)
+        {
+            benchmarkOptions.repeat = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--scale" && i + 1 < argc)
+        {
+            benchmarkOptions.scale = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--levels" && i + 1 < argc)
+        {
+            if (!parseLevels(argv[++i], options))
+            {
+                std::cout << usage();
+                return 0;
+            }
+        }
+        else if (arg == "--resize" && i + 1 < argc)
+        {
+            if (!parseResize(argv[++i], options))
+            {
+                std::cout << usage();
+                return 0;
+            }
+        }
+        else if (arg == "--filter" && i + 1 < argc && std::string_view(argv[i + 1]) == "box")
+        {
+            options.filter = ResizeFilter::eBox;
+            ++i;
+        }
+        else if (arg == "--filter" && i + 1 < argc && std::string_view(argv[i + 1]) == "kaiser")
+        {
+            options.filter = ResizeFilter::eKaiser;
+            ++i;
+        }
+        else if (arg == "--filter" && i + 1 < argc && std::string_view(argv[i + 1]) == "lanczos")
+        {
+            options.filter = ResizeFilter::eLanczos;
+            ++i;
+        }
+        else if (arg == "--incremental")
+        {
+            options.incremental = true;
+        }
+        else if (arg == "--mips")
+        {
+            options.mips = true;
+        }
+        else if (arg == "--shape" && i + 1 < argc && std::string_view(argv[i + 1]) == "plane")
+        {
+            renderOptions.shape = Shape::ePlane;
+            ++i;
+        }
+        else if (arg == "--shape" && i + 1 < argc && std::string_view(argv[i + 1]) == "sphere")
+        {
+            renderOptions.shape = Shape::eSphere;
+            ++i;
+        }
+        else if (arg == "--size" && i + 1 < argc)
+        {
+            renderOptions.size = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--roughness" && i + 1 < argc)
+        {
+            renderOptions.roughness = std::clamp(float(atof(argv[++i])), 0.f, 1.f);
+        }
+        else if (arg == "--max-rmse" && i + 1 < argc)
+        {
+            renderOptions.maxRmse = float(atof(argv[++i]));
+        }
+        else if (arg == "--scheduler" && i + 1 < argc && std::string_view(argv[i + 1]) == "pipeline")
+        {
+            pipelineOptions.scheduler = Scheduler::ePipeline;
+            ++i;
+        }
+        else if (arg == "--scheduler" && i + 1 < argc && std::string_view(argv[i + 1]) == "steal")
+        {
+            pipelineOptions.scheduler = Scheduler::eWorkStealing;
+            ++i;
+        }
+        else if (arg == "--io" && i + 1 < argc && std::string_view(argv[i + 1]) == "stdio")
+        {
+            pipelineOptions.io = IOBackend::eStdio;
+            ++i;
+        }
+        else if (arg == "--io" && i + 1 < argc && std::string_view(argv[i + 1]) == "threads")
+        {
+            pipelineOptions.io = IOBackend::eThreads;
+            ++i;
+        }
+        else if (arg == "--io" && i + 1 < argc && std::string_view(argv[i + 1]) == "uring")
+        {
+            pipelineOptions.io = IOBackend::eUring;
+            ++i;
+        }
+        else if (arg == "--processes" && i + 1 < argc)
+        {
+            pipelineOptions.processes = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--watch")
+        {
+            pipelineOptions.watch = true;
+        }
+        else if (arg == "--numa")
+        {
+            pipelineOptions.numa = true;
+            pipelineOptions.scheduler = Scheduler::eWorkStealing;
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            pipelineOptions.workerThreads = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--decode-threads" && i + 1 < argc)
+        {
+            pipelineOptions.decodeThreads = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--convert-threads" && i + 1 < argc)
+        {
+            pipelineOptions.convertThreads = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--encode-threads" && i + 1 < argc)
+        {
+            pipelineOptions.encodeThreads = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--queue-depth" && i + 1 < argc)
+        {
+            pipelineOptions.queueDepth = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg.starts_with("--"))
+        {
+            std::cout << usage();
+            return 0;
+        }
+        else
+        {
+            positional.emplace_back(arg);
+        }
+    }
+
+    if ((options.levels || options.resize || options.incremental) && !positional.empty() && (positional[0] == "gltf" || positional[0] == "array"))
+    {
+        std::cout << "--levels, --resize and --incremental apply to converting files, not to gltf scenes or arrays" << std::endl;
+        return 1;
+    }
+
+    // however the command below returns, report how well image memory was recycled
+    struct PoolReport
+    {
+        ~PoolReport()
+        {
+            reportBufferPool();
+        }
+    } poolReport;
+
+    if (!positional.empty() && positional[0] == "analyze")
+    {
+        if (positional.size() == 2)
+        {
+            return runAnalysis(positional[1], "", Type::e3Channel, options);
+        }
+        if (positional.size() == 4 && typeMapping.find(positional[3]) != typeMapping.end())
+        {
+            return runAnalysis(positional[1], positional[2], typeMapping[positional[3]], options);
+        }
+        std::cout << usage();
+        return 0;
+    }
+
+    if (!positional.empty() && positional[0] == "array")
+    {
+        if (positional.size() >= 5 && typeMapping.find(positional[positional.size() - 2]) != typeMapping.end()
+            && typeMapping.find(positional.back()) != typeMapping.end())
+        {
+            std::vector<std::string> filenames(positional.begin() + 2, positional.end() - 2);
+            return runArray(positional[1], filenames, typeMapping[positional[positional.size() - 2]], typeMapping[positional.back()], options, pipelineOptions, arrayOptions);
+        }
+        std::cout << usage();
+        return 0;
+    }
+
+    if (!positional.empty() && positional[0] == "gltf")
+    {
+        if ((positional.size() == 3 || positional.size() == 4) && typeMapping.find(positional.back()) != typeMapping.end()
+            && (positional.size() == 3 || typeMapping.find(positional[2]) != typeMapping.end()))
+        {
+            Type inputtype = positional.size() == 4 ? typeMapping[positional[2]] : Type::e3Channel;
+            return runGltf(positional[1], inputtype, typeMapping[positional.back()], options, pipelineOptions);
+        }
+        std::cout << usage();
+        return 0;
+    }
+
+    if (!positional.empty() && positional[0] == "manifest")
+    {
+        if (positional.size() == 2 || positional.size() == 3)
+        {
+            std::string resultfilename = positional.size() == 3 ? positional[2] : positional[1] + ".results.json";
+            return runManifest(positional[1], resultfilename, options, pipelineOptions);
+        }
+        std::cout << usage();
+        return 0;
+    }
+
+    if (!positional.empty() && positional[0] == "benchmark")
+    {
+        if (positional.size() == 4 && typeMapping.find(positional[2]) != typeMapping.end() && typeMapping.find(positional[3]) != typeMapping.end())
+        {
+            return runBenchmark(positional[1], typeMapping[positional[2]], typeMapping[positional[3]], options, benchmarkOptions);
+        }
+        std::cout << usage();
+        return 0;
+    }
+
+    if (!positional.empty() && positional[0] == "render")
+    {
+        if ((positional.size() == 4 || positional.size() == 6) && typeMapping.find(positional[3]) != typeMapping.end()
+            && (positional.size() == 4 || typeMapping.find(positional[5]) != typeMapping.end()))
+        {
+            std::vector<std::pair<std::string, Type>> inputs = { { positional[2], typeMapping[positional[3]] } };
+            if (positional.size() == 6)
+            {
+                inputs.emplace_back(positional[4], typeMapping[positional[5]]);
+            }
+            return runRender(positional[1], inputs, renderOptions);
+        }
+        std::cout << usage();
+        return 0;
+    }
+
+    if (positional.size() < 3)
+    {
+        std::cout << usage();
+        return 0;
+    }
+
+    std::vector<std::string> filenames(positional.begin(), positional.end() - 2);
+    std::string inputtype = positional[positional.size() - 2];
+    std::string outputtype = positional[positional.size() - 1];
+
+    if (typeMapping.find(inputtype) == typeMapping.end() || typeMapping.find(outputtype) == typeMapping.end())
+    {
+        std::cout << usage();
+        return 0;
+    }
+
+    Type outtype = typeMapping[outputtype];
+
+    if (!options.packChannels.empty() || !options.packInputs.empty())
+    {
+        std::string channels = options.packChannels.empty() ? std::string("rgb").substr(0, rawChannels(outtype)) : options.packChannels;
+        std::string used = channels;
+        for (const PackInput& input : options.packInputs)
+        {
+            used += "rgba"[input.channel];
+        }
+        bool valid = int(channels.size()) == rawChannels(outtype) && channels.find_first_not_of("rgba") == std::string::npos;
+        for (char c : used)
+        {
+            valid = valid && std::count(used.begin(), used.end(), c) == 1;
+        }
+        if (!valid || options.format != OutputFormat::ePng)
+        {
+            std::cout << std::format("--pack needs {0} distinct channels for {1} outputs, not shared with --pack-input, and PNG output\n", rawChannels(outtype), outputtype);
+            return 1;
+        }
+        options.packChannels = channels;
+    }
+
+    if (std::string conflict = optionConflicts(options); !conflict.empty())
+    {
+        std::cout << conflict << std::endl;
+        return 1;
+    }
+    if (options.incremental && (options.outputFile == "-" || filenames[0] == "-"))
+    {
+        std::cout << "--incremental patches an output file, so it can't write to stdout" << std::endl;
+        return 1;
+    }
+    if (options.levels && options.format == OutputFormat::ePng && (options.outputFile == "-" || (options.outputFile.empty() && filenames[0] == "-"))
+        && options.lastLevel != options.firstLevel)
+    {
+        std::cout << "Several --levels can only go to stdout with --format raw" << std::endl;
+        return 1;
+    }
+
+    if (!options.outputFile.empty() && filenames.size() > 1)
+    {
+        std::cout << "-o takes a single <inputfile>; use --output-root for several" << std::endl;
+        return 1;
+    }
+    if (std::find(filenames.begin(), filenames.end(), "-") != filenames.end() && filenames.size() > 1)
+    {
+        std::cout << "- must be the only <inputfile>" << std::endl;
+        return 1;
+    }
+
+    if (pipelineOptions.watch && (std::find(filenames.begin(), filenames.end(), "-") != filenames.end() || !options.outputFile.empty()))
+    {
+        std::cout << "--watch needs files or directories to watch and writes next to them or under --output-root" << std::endl;
+        return 1;
+    }
+
+    if (!options.outputRoot.empty() && options.inputRoot.empty())
+    {
+        options.inputRoot = commonDirectory(filenames);
+    }
+
+    if (pipelineOptions.watch)
+    {
+        return runWatch(filenames, typeMapping[inputtype], outtype, options, pipelineOptions);
+    }
+
+    bool toStdout = options.outputFile == "-" || (options.outputFile.empty() && filenames[0] == "-");
+    if (filenames[0] == "-" || toStdout)
+    {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+    if (toStdout)
+    {
+        // stdout carries the image, so messages move to stderr
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+
+    if (filenames.size() > 1 && pipelineOptions.processes > 1)
+    {
+        return runSharded(filenames, typeMapping[inputtype], outtype, options, pipelineOptions);
+    }
+    if (filenames.size() > 1 && pipelineOptions.scheduler == Scheduler::eWorkStealing)
+    {
+        return runWorkStealing(filenames, typeMapping[inputtype], outtype, options, pipelineOptions);
+    }
+    if (filenames.size() > 1)
+    {
+        return runPipeline(filenames, typeMapping[inputtype], outtype, options, pipelineOptions);
+    }
+
+    FileJob job;
+    job.filename = filenames[0];
+    job.loaded = loadData(job.filename, typeMapping[inputtype]);
+    if (job.loaded.data.empty())
+    {
+        return 1;
+    }
+
+    convertJob(job, outtype, options);
+
+    if (!hasOutput(job))
+    {
+        if (!job.error.empty())
+        {
+            std::cout << conversionFailure(job) << std::endl;
+            return 1;
+        }
+        std::cout << "Unsupported conversion: " << inputtype << " to " << outputtype << std::endl;
+        return 0;
+    }
+
+    return writeJob(job, options) ? 0 : 1;
+}
+
+void convertJob(FileJob& job, Type outtype, const ConversionOptions& options)
+{
+    if (options.incremental)
+    {
+        convertIncremental(job, outtype, options);
+    }
+    else if (options.levels)
+    {
+        if (options.firstLevel >= mipLevelCount(job.loaded.width, job.loaded.height))
+        {
+            job.error = std::format("a {0}x{1} texture has no mip level {2}", job.loaded.width, job.loaded.height, options.firstLevel);
+            job.loaded = {};
+            return;
+        }
+        std::vector<AnisotropyData> levels = convertLevels(job.loaded, outtype, options);
+        job.loaded = {};
+        if (!levels.empty())
+        {
+            job.transformed = std::move(levels[0]);
+            job.mipLevels.assign(std::make_move_iterator(levels.begin() + 1), std::make_move_iterator(levels.end()));
+        }
+    }
+    else if (options.resize)
+    {
+        job.transformed = resizeData(job.loaded, outtype, options);
+        job.loaded = {};
+    }
+    else if (options.roundtripReport)
+    {
+        job.transformed = convertWithRoundtrip(std::move(job.loaded), outtype, options, job.stats, job.errorImage);
+    }
+    else
+    {
+        job.transformed = convertData(std::move(job.loaded), outtype, options);
+    }
+}
+
+// False when the output couldn't be made, for the caller to count as a failure
+bool writeJob(const FileJob& job, const ConversionOptions& options)
+{
+    if (options.incremental)
+    {
+        return writeIncremental(job, options);
+    }
+    if (options.levels)
+    {
+        return writeLevels(job, options, nullptr);
+    }
+    if (!options.packChannels.empty())
+    {
+        AnisotropyData packed = packChannels(job.filename, job.transformed, options);
+        if (packed.data.empty() || !writeData(job.filename, packed, options))
+        {
+            return false;
+        }
+    }
+    else if (!writeData(job.filename, job.transformed, options))
+    {
+        return false;
+    }
+
+    if (options.roundtripReport)
+    {
+        writeRoundtripReport(job.filename, job.transformed, job.stats, job.errorImage, options);
+    }
+    return true;
+}
+
+// As writeJob, but only deflates here and leaves writing the file to the I/O threads, which
+// call done with whether that worked; false only for failures found before the write is queued
+bool writeJobAsync(const FileJob& job, const ConversionOptions& options, AsyncFileIO& io, std::function<void(bool ok)> done)
+{
+    if (options.incremental)
+    {
+        // patches are written in place, which the I/O threads don't do
+        return writeIncremental(job, options);
+    }
+    if (options.levels)
+    {
+        return writeLevels(job, options, &io, std::move(done));
+    }
+    std::string outputfilename = outputFilename(job.filename, job.transformed.type, options);
+    if (!options.packChannels.empty())
+    {
+        AnisotropyData packed = packChannels(job.filename, job.transformed, options);
+        if (packed.data.empty())
+        {
+            return false;
+        }
+        createParentDirectories(outputfilename);
+        io.write(outputfilename, encodeData(packed, options), std::move(done));
+    }
+    else
+    {
+        createParentDirectories(outputfilename);
+        io.write(outputfilename, encodeData(job.transformed, options), std::move(done));
+    }
+
+    if (options.roundtripReport)
+    {
+        writeRoundtripReport(job.filename, job.transformed, job.stats, job.errorImage, options);
+    }
+    return true;
+}
+
+// <first>, <first>..<last> or <first>..end
+bool parseLevels(std::string_view range, ConversionOptions& options)
+{
+    size_t dots = range.find("..");
+    std::string first(range.substr(0, dots));
+    std::string last(dots == std::string_view::npos ? range : range.substr(dots + 2));
+    options.levels = true;
+    options.firstLevel = atoi(first.c_str());
+    options.lastLevel = last == "end" ? -1 : atoi(last.c_str());
+    return !first.empty() && first.find_first_not_of("0123456789") == std::string::npos
+        && (last == "end" || (!last.empty() && last.find_first_not_of("0123456789") == std::string::npos && options.lastLevel >= options.firstLevel));
+}
+
+// <width>x<height> or <percent>%
+bool parseResize(std::string_view size, ConversionOptions& options)
+{
+    std::string text(size);
+    size_t cross = text.find('x');
+    options.resize = true;
+    options.resizeScale = 0.f;
+    options.resizeWidth = 0;
+    options.resizeHeight = 0;
+    if (!text.empty() && text.back() == '%')
+    {
+        options.resizeScale = float(atof(text.c_str())) / 100.f;
+    }
+    else if (cross != std::string::npos)
+    {
+        options.resizeWidth = atoi(text.c_str());
+        options.resizeHeight = atoi(text.c_str() + cross + 1);
+    }
+    return options.resizeScale > 0.f || (options.resizeWidth > 0 && options.resizeHeight > 0);
+}
+
+// Why these options can't be used together, empty when they can
+std::string optionConflicts(const ConversionOptions& options)
+{
+    if ((options.levels || options.resize) && (options.roundtripReport || !options.packChannels.empty()))
+    {
+        return "--levels and --resize can't be combined with --roundtrip-report or --pack";
+    }
+    if (options.incremental && (options.format != OutputFormat::eRaw || options.mips || options.levels || options.resize || options.roundtripReport
+        || !options.packChannels.empty() || options.dither == Dither::eDiffusion))
+    {
+        return "--incremental needs --format raw, without --mips, --levels, --resize, --pack, --roundtrip-report or --dither diffusion";
+    }
+    if (options.levels && options.resize)
+    {
+        return "--levels and --resize can't be combined";
+    }
+    return "";
+}
+
+// The requested levels in one raw container, or each as <output>.mip<n>.png; through the I/O
+// threads when given
+bool writeLevels(const FileJob& job, const ConversionOptions& options, AsyncFileIO* io, std::function<void(bool ok)> done)
+{
+    std::vector<const AnisotropyData*> levels = { &job.transformed };
+    for (const AnisotropyData& level : job.mipLevels)
+    {
+        levels.push_back(&level);
+    }
+
+    std::string outputfilename = outputFilename(job.filename, job.transformed.type, options);
+    std::vector<std::pair<std::string, std::vector<uint8_t>>> files;
+    if (options.format == OutputFormat::eRaw)
+    {
+        files.emplace_back(outputfilename, encodeRawLevels(levels));
+    }
+    else
+    {
+        for (size_t i = 0; i < levels.size(); ++i)
+        {
+            // a single level keeps the name -o gives it
+            bool named = !options.outputFile.empty() && levels.size() == 1;
+            files.emplace_back(named ? outputfilename : levelFilename(outputfilename, options.firstLevel + int(i)), encodeData(*levels[i], options));
+        }
+    }
+
+    // with I/O threads, done hears once whether every level of the job was written
+    struct PendingWrites
+    {
+        std::atomic<int> remaining = 0;
+        std::atomic<bool> ok = true;
+        std::function<void(bool ok)> done;
+    };
+    auto pending = std::make_shared<PendingWrites>();
+    pending->done = std::move(done);
+    pending->remaining = int(std::count_if(files.begin(), files.end(), [](const auto& file) { return file.first != "-"; }));
+
+    bool written = true;
+    for (auto& [filename, bytes] : files)
+    {
+        if (filename == "-")
+        {
+            fwrite(bytes.data(), 1, bytes.size(), stdout);
+            if (fflush(stdout) != 0)
+            {
+                std::cout << "Failed to write stdout" << std::endl;
+                written = false;
+            }
+            continue;
+        }
+        createParentDirectories(filename);
+        if (io)
+        {
+            io->write(filename, std::move(bytes), [pending](bool ok) {
+                if (!ok)
+                {
+                    pending->ok = false;
+                }
+                if (--pending->remaining == 0 && pending->done)
+                {
+                    pending->done(pending->ok);
+                }
+            });
+            continue;
+        }
+        std::ofstream file(filename, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        file.close();
+        if (!file)
+        {
+            std::cout << "Failed to write " << filename << std::endl;
+            written = false;
+        }
+    }
+    return written;
+}
+
+// The hashes of <outputfilename>.tiles, if they describe <input> converted to <outtype> with
+// these options and the output is a raw container they can be patched into; empty otherwise
+std::vector<uint64_t> readTileHashes(const std::string& outputfilename, const AnisotropyData& input, Type outtype, const ConversionOptions& options)
+{
+    std::ifstream sidecar(outputfilename + ".tiles", std::ios::binary);
+    TilesHeader tiles = {};
+    sidecar.read(reinterpret_cast<char*>(&tiles), sizeof(tiles));
+    if (!sidecar || memcmp(tiles.magic, tilesMagic, sizeof(tilesMagic)) != 0 || tiles.version != 2 || tiles.tileSize != uint32_t(incrementalTileSize)
+        || tiles.inputType != uint32_t(input.type) || tiles.outputType != uint32_t(outtype) || tiles.width != uint32_t(input.width)
+        || tiles.height != uint32_t(input.height) || tiles.encoder != uint32_t(options.encoder) || tiles.dither != uint32_t(options.dither))
+    {
+        return {};
+    }
+
+    std::error_code error;
+    auto modified = std::filesystem::last_write_time(outputfilename, error);
+    if (error || tiles.outputModified != int64_t(modified.time_since_epoch().count()))
+    {
+        return {};
+    }
+    std::ifstream output(outputfilename, std::ios::binary | std::ios::ate);
+    uint64_t size = uint64_t(std::max<std::streamoff>(0, output.tellg()));
+    output.seekg(0);
+    if (size != tiles.outputSize)
+    {
+        return {};
+    }
+    RawHeader header = {};
+    output.read(reinterpret_cast<char*>(&header), sizeof(header));
+    const RawLevel& level = header.levels[0];
+    if (!output || memcmp(header.magic, rawMagic, sizeof(rawMagic)) != 0 || header.version != 1 || header.type != uint32_t(outtype)
+        || header.numLevels != 1 || header.numChannels != uint32_t(rawChannels(outtype)) || level.width != tiles.width || level.height != tiles.height
+        || !rawLevelFits(header, level, size))
+    {
+        return {};
+    }
+
+    std::vector<uint64_t> hashes(tiles.numTiles);
+    sidecar.read(reinterpret_cast<char*>(hashes.data()), std::streamsize(hashes.size() * sizeof(uint64_t)));
+    return sidecar ? hashes : std::vector<uint64_t>();
+}
+
+// Hashes the input in tiles and converts only those that changed since the output was
+// written, when that output can be patched; otherwise converts the whole image
+void convertIncremental(FileJob& job, Type outtype, const ConversionOptions& options)
+{
+    constexpr int tileSize = incrementalTileSize;
+    const AnisotropyData& input = job.loaded;
+    int tilesX = (input.width + tileSize - 1) / tileSize;
+    int tilesY = (input.height + tileSize - 1) / tileSize;
+    size_t rowBytes = size_t(input.width) * input.numChannels;
+    job.tileHashes.assign(size_t(tilesX) * tilesY, 0);
+    job.hashedType = input.type;
+    parallelFor(size_t(tilesY), [&](size_t, size_t begin, size_t end) {
+        for (size_t tileY = begin; tileY < end; ++tileY)
+        {
+            for (int tileX = 0; tileX < tilesX; ++tileX)
+            {
+                int x = tileX * tileSize;
+                int width = std::min(tileSize, input.width - x);
+                uint64_t hash = 0;
+                for (int y = int(tileY) * tileSize; y < std::min(int(tileY + 1) * tileSize, input.height); ++y)
+                {
+                    hash = (hash ^ hashWords(&input.data[y * rowBytes + size_t(x) * input.numChannels], size_t(width) * input.numChannels)) * 0x100000001b3ull;
+                }
+                job.tileHashes[tileY * tilesX + tileX] = hash;
+            }
+        }
+    });
+
+    std::vector<uint64_t> previous = readTileHashes(outputFilename(job.filename, outtype, options), input, outtype, options);
+    if (previous.size() != job.tileHashes.size())
+    {
+        job.transformed = convertData(std::move(job.loaded), outtype, options);
+        return;
+    }
+
+    std::vector<size_t> dirty;
+    for (size_t i = 0; i < previous.size(); ++i)
+    {
+        if (previous[i] != job.tileHashes[i])
+        {
+            dirty.push_back(i);
+        }
+    }
+
+    // whole multiples of 8 texels keep the ordered dither pattern of a full conversion
+    job.patches.resize(dirty.size());
+    parallelFor(dirty.size(), [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+        {
+            TilePatch& patch = job.patches[i];
+            patch.x = int(dirty[i] % tilesX) * tileSize;
+            patch.y = int(dirty[i] / tilesX) * tileSize;
+            AnisotropyData tile = { .width = std::min(tileSize, input.width - patch.x), .height = std::min(tileSize, input.height - patch.y),
+                .numChannels = input.numChannels, .type = input.type };
+            tile.data.resize(size_t(tile.width) * tile.height * tile.numChannels);
+            for (int y = 0; y < tile.height; ++y)
+            {
+                memcpy(&tile.data[size_t(y) * tile.width * tile.numChannels], &input.data[(patch.y + y) * rowBytes + size_t(patch.x) * input.numChannels],
+                    size_t(tile.width) * tile.numChannels);
+            }
+            patch.image = convertData(std::move(tile), outtype, options);
+        }
+    });
+
+    job.patched = std::all_of(job.patches.begin(), job.patches.end(), [](const TilePatch& patch) { return !patch.image.data.empty(); });
+    job.transformed = { .width = input.width, .height = input.height, .numChannels = 3, .type = outtype };
+    job.loaded = {};
+}
+
+// Patches the changed tiles into the existing output, or writes it whole, then records the
+// tile hashes. The sidecar goes first and is replaced last, so an interrupted run leaves
+// tiles that are reconverted next time rather than a sidecar vouching for a stale output.
+bool writeIncremental(const FileJob& job, const ConversionOptions& options)
+{
+    std::string outputfilename = outputFilename(job.filename, job.transformed.type, options);
+    std::string sidecarfilename = outputfilename + ".tiles";
+    if (!job.patched)
+    {
+        std::error_code error;
+        std::filesystem::remove(sidecarfilename, error);
+        if (!writeData(job.filename, job.transformed, options))
+        {
+            return false;
+        }
+        std::cout << std::format("{0}: converted all {1} tiles\n", outputfilename, job.tileHashes.size());
+    }
+    else
+    {
+        std::fstream file(outputfilename, std::ios::in | std::ios::out | std::ios::binary);
+        RawHeader header = {};
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        const RawLevel& level = header.levels[0];
+        std::vector<uint8_t> row;
+        for (const TilePatch& patch : job.patches)
+        {
+            const AnisotropyData& image = patch.image;
+            row.resize(size_t(image.width) * header.numChannels);
+            for (int y = 0; y < image.height; ++y)
+            {
+                for (int x = 0; x < image.width; ++x)
+                {
+                    memcpy(&row[size_t(x) * header.numChannels], &image.data[(size_t(y) * image.width + x) * image.numChannels], header.numChannels);
+                }
+                file.seekp(std::streamoff(level.offset + uint64_t(patch.y + y) * level.rowBytes + uint64_t(patch.x) * header.numChannels));
+                file.write(reinterpret_cast<const char*>(row.data()), std::streamsize(row.size()));
+            }
+        }
+        file.close();
+        if (!file)
+        {
+            std::cout << "Failed to patch " << outputfilename << std::endl;
+            return false;
+        }
+        std::cout << std::format("{0}: reconverted {1} of {2} tiles\n", outputfilename, job.patches.size(), job.tileHashes.size());
+    }
+
+    TilesHeader tiles = {};
+    memcpy(tiles.magic, tilesMagic, sizeof(tilesMagic));
+    tiles.version = 2;
+    tiles.tileSize = uint32_t(incrementalTileSize);
+    tiles.inputType = uint32_t(job.hashedType);
+    tiles.outputType = uint32_t(job.transformed.type);
+    tiles.width = uint32_t(job.transformed.width);
+    tiles.height = uint32_t(job.transformed.height);
+    tiles.encoder = uint32_t(options.encoder);
+    tiles.dither = uint32_t(options.dither);
+    tiles.numTiles = job.tileHashes.size();
+    std::error_code error;
+    tiles.outputSize = std::filesystem::file_size(outputfilename, error);
+    tiles.outputModified = int64_t(std::filesystem::last_write_time(outputfilename, error).time_since_epoch().count());
+    if (error)
+    {
+        // the output is written; without a sidecar the next run just converts it all again
+        return true;
+    }
+    {
+        std::ofstream sidecar(sidecarfilename + ".tmp", std::ios::binary);
+        sidecar.write(reinterpret_cast<const char*>(&tiles), sizeof(tiles));
+        sidecar.write(reinterpret_cast<const char*>(job.tileHashes.data()), std::streamsize(job.tileHashes.size() * sizeof(uint64_t)));
+    }
+    std::filesystem::rename(sidecarfilename + ".tmp", sidecarfilename, error);
+    return true;
+}
+
+AnisotropyData convertData(AnisotropyData loaded, Type outtype, const ConversionOptions& options)
+{
+    AnisotropyData transformed;
+
+    if (loaded.type == Type::eOld3Channel)
+    {
+        loaded = old3_to_new3(loaded);
+    }
+    else if (loaded.type == Type::eAngle)
+    {
+        loaded = angle_to_new3(loaded);
+    }
+
+    if (options.dither != Dither::eNone && (loaded.type == Type::e3Channel || loaded.type == Type::e2D) && (outtype == Type::e2D || outtype == Type::eAngle) && loaded.type != outtype)
+    {
+        return dither_to_mag2d_or_angle(loaded, outtype, options.dither);
+    }
+
+    if (loaded.type == Type::e3Channel)
+    {
+        if (outtype == Type::e2D && options.encoder == Encoder::eOptimal)
+        {
+            transformed = new3_to_mag2d_optimal(loaded);
+        }
+        else if (outtype == Type::e2D && options.layout == Layout::ePlanar)
+        {
+            transformed = new3_to_mag2d_planar(loaded);
+        }
+        else if (outtype == Type::e2D)
+        {
+            transformed = new3_to_mag2d(loaded);
+        }
+        else if (outtype == Type::eAngle)
+        {
+            transformed = new3_to_angle(loaded);
+        }
+        else if (outtype == Type::e3Channel)
+        {
+            transformed = loaded;
+        }
+    }
+
+    if (loaded.type == Type::e2D)
+    {
+        if (outtype == Type::eAngle)
+        {
+            transformed = mag2d_to_angle(loaded);
+        }
+        else if (outtype == Type::e3Channel && options.layout == Layout::ePlanar)
+        {
+            transformed = mag2d_to_new3_planar(loaded);
+        }
+        else if (outtype == Type::e3Channel)
+        {
+            transformed = mag2d_to_new3(loaded);
+        }
+    }
+
+    return transformed;
+}
+
+AnisotropyData loadData(const std::string& filename, Type anisotropyType)
+{
+    if (filename == "-")
+    {
+        return loadDataFromStdin(anisotropyType);
+    }
+
+    // decode straight from the page cache where the file can be mapped
+    MappedFile mapped(filename);
+    if (mapped.data())
+    {
+        return loadDataFromMemory(filename, mapped.data(), mapped.size(), anisotropyType);
+    }
+
+    //int numChannels = (anisotropyType == Type::e2D || anisotropyType == Type::eAngle) ? 2 : 3;
+    int numChannels = 3;
+
+    int w, h, n;
+    unsigned char* input = stbi_load(filename.c_str(), &w, &h, &n, numChannels);
+    if (!input)
+    {
+        std::cout << "Failed to load " << filename << ": " << stbi_failure_reason() << std::endl;
+        return { .type = anisotropyType };
+    }
+
+    assert(n == numChannels);
+    ImageBytes result(input, input + size_t(w) * h * numChannels);
+
+    stbi_image_free(input);
+
+    return { .data = std::move(result), .width = w, .height = h, .numChannels = numChannels, .type = anisotropyType };
+}
+
+AnisotropyData loadDataFromMemory(const std::string& filename, const uint8_t* bytes, size_t size, Type anisotropyType)
+{
+    if (size >= sizeof(RawHeader) && memcmp(bytes, rawMagic, sizeof(rawMagic)) == 0)
+    {
+        return decodeRaw(filename, bytes, size, anisotropyType);
+    }
+
+    int numChannels = 3;
+
+    int w, h, n;
+    unsigned char* input = stbi_load_from_memory(bytes, int(size), &w, &h, &n, numChannels);
+    if (!input)
+    {
+        std::cout << "Failed to decode " << filename << ": " << stbi_failure_reason() << std::endl;
+        return { .type = anisotropyType };
+    }
+
+    ImageBytes result(input, input + size_t(w) * h * numChannels);
+
+    stbi_image_free(input);
+
+    return { .data = std::move(result), .width = w, .height = h, .numChannels = numChannels, .type = anisotropyType };
+}
+
+AnisotropyData old3_to_new3(const AnisotropyData& old3channel)
+{
+    AnisotropyData result;
+    result.width = old3channel.width;
+    result.height = old3channel.height;
+    result.numChannels = 3;
+    result.type = Type::e3Channel;
+
+    result.data.resize(result.width * result.height * result.numChannels);
+
+    size_t srcOffset = 0;
+    size_t destOffset = 0;
+    for (int y = 0; y < old3channel.height; ++y)
+    {
+        for (int x = 0; x < old3channel.width; ++x)
+        {
+            uint8_t dirx = old3channel.data[srcOffset];
+            uint8_t diry = old3channel.data[srcOffset + 1];
+            uint8_t str = old3channel.data[srcOffset + 2];
+            srcOffset += old3channel.numChannels;
+
+            if (str < 128)
+            {
+                std::swap(dirx, diry);
+                str = 128 - str;
+            }
+            else
+            {
+                str = str - 128;
+            }
+            str = uint8_t(255.0 * str / 128.0);
+
+            result.data[destOffset] = dirx;
+            result.data[destOffset + 1] = diry;
+            result.data[destOffset + 2] = str;
+            destOffset += result.numChannels;
+        }
+    }
+
+    return result;
+}
+
+AnisotropyData angle_to_new3(const AnisotropyData& input)
+{
+    AnisotropyData result;
+    result.width = input.width;
+    result.height = input.height;
+    result.numChannels = 3;
+    result.type = Type::e2D;
+
+    result.data.assign(result.width * result.height * result.numChannels, 0);
+
+    size_t srcOffset = 0;
+    size_t destOffset = 0;
+    for (int y = 0; y < input.height; ++y)
+    {
+        for (int x = 0; x < input.width; ++x)
+        {
+            uint8_t angle = input.data[srcOffset];
+            uint8_t str = input.data[srcOffset + 1];
+            srcOffset += input.numChannels;
+
+            float dirx, diry;
+            angleToDir(angle, dirx, diry);
+
+            normalize(dirx, diry);
+
+            result.data[destOffset] = uint8_t(dirx * 255.f);
+            result.data[destOffset + 1] = uint8_t(diry * 255.f);
+            result.data[destOffset + 2] = str;
+        }
+    }
+
+    return result;
+}
+
+AnisotropyData mag2d_to_new3(const AnisotropyData& input)
+{
+    AnisotropyData result;
+    result.width = input.width;
+    result.height = input.height;
+    result.numChannels = 3;
+    result.type = Type::e3Channel;
+
+    result.data.resize(result.width * result.height * result.numChannels);
+
+    size_t srcOffset = 0;
+    size_t destOffset = 0;
+    for (int y = 0; y < input.height; ++y)
+    {
+        for (int x = 0; x < input.width; ++x)
+        {
+            uint8_t dirx = input.data[srcOffset];
+            uint8_t diry = input.data[srcOffset + 1];
+            srcOffset += input.numChannels;
+
+            decodeMag2D(dirx, diry, result.data[destOffset], result.data[destOffset + 1], result.data[destOffset + 2]);
+            destOffset += 3;
+        }
+    }
+
+    return result;
+}
+
+AnisotropyData mag2d_to_angle(const AnisotropyData& input)
+{
+    AnisotropyData result;
+    result.width = input.width;
+    result.height = input.height;
+    result.numChannels = 3;
+    result.type = Type::eAngle;
+
+    result.data.resize(result.width * result.height * result.numChannels);
+
+    size_t srcOffset = 0;
+    size_t destOffset = 0;
+    for (int y = 0; y < input.height; ++y)
+    {
+        for (int x = 0; x < input.width; ++x)
+        {
+            float dirx = float(input.data[srcOffset]);
+            float diry = float(input.data[srcOffset + 1]);
+            srcOffset += input.numChannels;
+            toVecSpace(dirx, diry);
+
+            float strength = std::min(sqrt(dirx * dirx + diry * diry), 1.f);
+
+            result.data[destOffset] = directionToAngle(dirx, diry);
+            result.data[destOffset + 1] = uint8_t(strength * 255.f);
+            result.data[destOffset + 2] = 0;
+            destOffset += 3;
+        }
+    }
+
+    return result;
+}
+
+AnisotropyData new3_to_angle(const AnisotropyData& input)
+{
+    AnisotropyData result;
+    result.width = input.width;
+    result.height = input.height;
+    result.numChannels = 3;
+    result.type = Type::eAngle;
+
+    result.data.resize(result.width * result.height * result.numChannels);
+
+    size_t srcOffset = 0;
+    size_t destOffset = 0;
+    for (int y = 0; y < input.height; ++y)
+    {
+        for (int x = 0; x < input.width; ++x)
+        {
+            float dirx = float(input.data[srcOffset]);
+            float diry = float(input.data[srcOffset + 1]);
+            unsigned char str = input.data[srcOffset + 2];
+            srcOffset += input.numChannels;
+            toVecSpace(dirx, diry);
+
+            result.data[destOffset] = directionToAngle(dirx, diry);
+            result.data[destOffset + 1] = str;
+            result.data[destOffset + 2] = 0;
+            destOffset += 3;
+        }
+    }
+
+    return result;
+}
+
+AnisotropyData new3_to_mag2d(const AnisotropyData& input)
+{
+    AnisotropyData result;
+    result.width = input.width;
+    result.height = input.height;
+    result.numChannels = 3;
+    result.type = Type::e2D;
+
+    result.data.resize(result.width * result.height * result.numChannels);
+
+    size_t srcOffset = 0;
+    size_t destOffset = 0;
+    for (int y = 0; y < input.height; ++y)
+    {
+        for (int x = 0; x < input.width; ++x)
+        {
+            unsigned char dirx = input.data[srcOffset];
+            unsigned char diry = input.data[srcOffset + 1];
+            unsigned char str = input.data[srcOffset + 2];
+            srcOffset += input.numChannels;
+
+            auto [encodedx, encodedy] = encodeMag2D(dirx, diry, str);
+
+            result.data[destOffset] = encodedx;
+            result.data[destOffset + 1] = encodedy;
+            result.data[destOffset + 2] = 0;
+            destOffset += 3;
+        }
+    }
+
+    return result;
+}
+
+PlanarImage allocatePlanar(int width, int height, Type type)
+{
+    PlanarImage image;
+    image.width = width;
+    image.height = height;
+    image.type = type;
+    image.stride = (size_t(width) + PlanarImage::alignment - 1) / PlanarImage::alignment * PlanarImage::alignment;
+    size_t size = image.stride * height * PlanarImage::numPlanes;
+    image.memory = std::unique_ptr<uint8_t[], PlanarImage::Release>(static_cast<uint8_t*>(acquireBuffer(size)), PlanarImage::Release{ size });
+    return image;
+}
+
+// Row y of an interleaved image into the planes of a one row PlanarImage, and back
+void deinterleaveRow(const AnisotropyData& input, int y, PlanarImage& row)
+{
+    int numChannels = std::min(input.numChannels, PlanarImage::numPlanes);
+    const uint8_t* src = &input.data[size_t(y) * input.width * input.numChannels];
+    for (int c = 0; c < PlanarImage::numPlanes; ++c)
+    {
+        uint8_t* dest = row.row(c, 0);
+        if (c >= numChannels)
+        {
+            memset(dest, 0, input.width);
+            continue;
+        }
+        for (int x = 0; x < input.width; ++x)
+        {
+            dest[x] = src[x * input.numChannels + c];
+        }
+    }
+}
+
+void interleaveRow(const PlanarImage& row, AnisotropyData& output, int y)
+{
+    uint8_t* dest = &output.data[size_t(y) * output.width * 3];
+    const uint8_t* x0 = row.row(0, 0);
+    const uint8_t* x1 = row.row(1, 0);
+    const uint8_t* x2 = row.row(2, 0);
+    for (int x = 0; x < output.width; ++x)
+    {
+        dest[x * 3] = x0[x];
+        dest[x * 3 + 1] = x1[x];
+        dest[x * 3 + 2] = x2[x];
+    }
+}
+
+// new3_to_mag2d and mag2d_to_new3 on planes; the batch kernels match the per-pixel ones bit
+// for bit and vectorize over each row, which is split into planes just before and
+// interleaved into the output right after, while it is still in cache
+AnisotropyData new3_to_mag2d_planar(const AnisotropyData& input)
+{
+    AnisotropyData result = { .width = input.width, .height = input.height, .numChannels = 3, .type = Type::e2D };
+    result.data.resize(size_t(input.width) * input.height * 3);
+    PlanarImage in = allocatePlanar(input.width, 1, input.type);
+    PlanarImage out = allocatePlanar(input.width, 1, Type::e2D);
+    memset(out.row(2, 0), 0, input.width);
+    for (int y = 0; y < input.height; ++y)
+    {
+        deinterleaveRow(input, y, in);
+        encodeMag2DBatch(in.row(0, 0), in.row(1, 0), in.row(2, 0), out.row(0, 0), out.row(1, 0), size_t(input.width));
+        interleaveRow(out, result, y);
+    }
+    return result;
+}
+
+AnisotropyData mag2d_to_new3_planar(const AnisotropyData& input)
+{
+    AnisotropyData result = { .width = input.width, .height = input.height, .numChannels = 3, .type = Type::e3Channel };
+    result.data.resize(size_t(input.width) * input.height * 3);
+    PlanarImage in = allocatePlanar(input.width, 1, input.type);
+    PlanarImage out = allocatePlanar(input.width, 1, Type::e3Channel);
+    for (int y = 0; y < input.height; ++y)
+    {
+        deinterleaveRow(input, y, in);
+        decodeMag2DBatch(in.row(0, 0), in.row(1, 0), out.row(0, 0), out.row(1, 0), out.row(2, 0), size_t(input.width));
+        interleaveRow(out, result, y);
+    }
+    return result;
+}
+
+AnisotropyData new3_to_mag2d_optimal(const AnisotropyData& input)
+{
+    AnisotropyData result;
+    result.width = input.width;
+    result.height = input.height;
+    result.numChannels = 3;
+    result.type = Type::e2D;
+
+    result.data.resize(result.width * result.height * result.numChannels);
+
+    size_t srcOffset = 0;
+    size_t destOffset = 0;
+    for (int y = 0; y < input.height; ++y)
+    {
+        for (int x = 0; x < input.width; ++x)
+        {
+            unsigned char dirx = input.data[srcOffset];
+            unsigned char diry = input.data[srcOffset + 1];
+            unsigned char str = input.data[srcOffset + 2];
+            srcOffset += input.numChannels;
+
+            auto [encodedx, encodedy] = encodeMag2DOptimal(dirx, diry, str);
+
+            result.data[destOffset] = encodedx;
+            result.data[destOffset + 1] = encodedy;
+            result.data[destOffset + 2] = 0;
+            destOffset += 3;
+        }
+    }
+
+    return result;
+}
+
+// 8x8 Bayer matrix, thresholds are (value + 0.5) / 64
+constexpr uint8_t bayer8[8][8] = {
+    { 0, 32, 8, 40, 2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44, 4, 36, 14, 46, 6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    { 3, 35, 11, 43, 1, 33, 9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47, 7, 39, 13, 45, 5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+float orderedThreshold(int x, int y)
+{
+    return (bayer8[y & 7][x & 7] + 0.5f) / 64.f;
+}
+
+// quantizes a vector space component [-1,1] to 8 bits, threshold 0.5 rounds to nearest
+uint8_t quantizeVecComponent(float v, float threshold)
+{
+    float tex = std::min((v + 1.f) * 0.5f, 1.f);
+    return uint8_t(std::clamp(int(std::floor(tex * 255.f + threshold)), 0, 255));
+}
+
+// quantizes an angular rotation [0, 2pi] like angleToUNorm, threshold 0.5 rounds to nearest
+uint8_t quantizeAngle(float theta, float threshold)
+{
+    float v = theta / (2.f * std::numbers::pi_v<float>);
+    return uint8_t(std::clamp(int(std::floor(v * 255.f + threshold)), 0, 255));
+}
+
+// Floyd-Steinberg error diffusion of a 2D vector field. quantize(x, y, desired) writes the
+// output pixel and returns the decoded vector, and may adjust desired to the value it actually
+// quantized; the difference between the two is pushed on to the unvisited neighbours. Rows
+// are handed round robin to threads and each row trails the one above it by two pixels, the
+// furthest its incoming error can come from, so the serial scan order is preserved while
+// every thread works on its own row.
+template <typename TargetFn, typename QuantizeFn>
+void diffuseError(int width, int height, TargetFn&& target, QuantizeFn&& quantize)
+{
+    int numThreads = onPoolWorker ? 1 : int(std::min<size_t>(parallelChunks(), std::max(height, 1)));
+    // each row adds error into the next row's buffer; the ring must cover all rows in flight
+    int ringRows = 2 * numThreads + 2;
+    std::vector<std::vector<std::array<float, 2>>> ring(ringRows, std::vector<std::array<float, 2>>(width + 2));
+    std::vector<std::atomic<int>> progress(height);
+    for (std::atomic<int>& rowProgress : progress)
+    {
+        rowProgress.store(0, std::memory_order_relaxed);
+    }
+
+    auto waitFor = [&](int row, int columns) {
+        while (progress[row].load(std::memory_order_acquire) < columns)
+        {
+            std::this_thread::yield();
+        }
+    };
+
+    auto processRows = [&](int thread) {
+        for (int y = thread; y < height; y += numThreads)
+        {
+            // the buffer this row writes was last read by row y + 1 - ringRows
+            if (y + 1 - ringRows >= 0)
+            {
+                waitFor(y + 1 - ringRows, width);
+            }
+            std::vector<std::array<float, 2>>& incoming = ring[y % ringRows];
+            std::vector<std::array<float, 2>>& outgoing = ring[(y + 1) % ringRows];
+            std::fill(outgoing.begin(), outgoing.end(), std::array<float, 2>{ 0.f, 0.f });
+
+            // error to the right stays in registers since the row below never reads it
+            std::array<float, 2> carry = { 0.f, 0.f };
+            for (int x = 0; x < width; ++x)
+            {
+                if (y > 0)
+                {
+                    waitFor(y - 1, std::min(x + 2, width));
+                }
+
+                std::array<float, 2> desired = target(x, y);
+                desired[0] += carry[0] + (y > 0 ? incoming[x + 1][0] : 0.f);
+                desired[1] += carry[1] + (y > 0 ? incoming[x + 1][1] : 0.f);
+
+                std::array<float, 2> decoded = quantize(x, y, desired);
+                float errorx = desired[0] - decoded[0];
+                float errory = desired[1] - decoded[1];
+
+                carry = { errorx * 7.f / 16.f, errory * 7.f / 16.f };
+                outgoing[x][0] += errorx * 3.f / 16.f;
+                outgoing[x][1] += errory * 3.f / 16.f;
+                outgoing[x + 1][0] += errorx * 5.f / 16.f;
+                outgoing[x + 1][1] += errory * 5.f / 16.f;
+                outgoing[x + 2][0] += errorx * 1.f / 16.f;
+                outgoing[x + 2][1] += errory * 1.f / 16.f;
+
+                progress[y].store(x + 1, std::memory_order_release);
+            }
+        }
+    };
+
+    if (numThreads == 1)
+    {
+        processRows(0);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < numThreads; ++thread)
+    {
+        threads.emplace_back(processRows, thread);
+    }
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+AnisotropyData dither_to_mag2d_or_angle(const AnisotropyData& input, Type outtype, Dither dither)
+{
+    AnisotropyData result;
+    result.width = input.width;
+    result.height = input.height;
+    result.numChannels = 3;
+    result.type = outtype;
+
+    result.data.resize(result.width * result.height * result.numChannels);
+
+    // the 2D encoding dithers the direction scaled by strength, the angle encoding dithers
+    // the unit direction and carries the strength through
+    auto target = [&](int x, int y) {
+        size_t srcOffset = (size_t(y) * input.width + x) * input.numChannels;
+        float dirx = float(input.data[srcOffset]);
+        float diry = float(input.data[srcOffset + 1]);
+        toVecSpace(dirx, diry);
+        float strength = input.type == Type::e2D ? std::min(sqrt(dirx * dirx + diry * diry), 1.f) : input.data[srcOffset + 2] / 255.f;
+        normalize(dirx, diry);
+        if (outtype == Type::e2D)
+        {
+            dirx *= strength;
+            diry *= strength;
+        }
+        return std::array<float, 2>{ dirx, diry };
+    };
+
+    auto strengthOf = [&](int x, int y) {
+        size_t srcOffset = (size_t(y) * input.width + x) * input.numChannels;
+        if (input.type == Type::e2D)
+        {
+            float dirx = float(input.data[srcOffset]);
+            float diry = float(input.data[srcOffset + 1]);
+            toVecSpace(dirx, diry);
+            return uint8_t(std::min(sqrt(dirx * dirx + diry * diry), 1.f) * 255.f);
+        }
+        return input.data[srcOffset + 2];
+    };
+
+    auto quantize = [&](int x, int y, std::array<float, 2> desired, float thresholdx, float thresholdy) {
+        size_t destOffset = (size_t(y) * result.width + x) * result.numChannels;
+        std::array<float, 2> decoded;
+        if (outtype == Type::e2D)
+        {
+            uint8_t codex = quantizeVecComponent(desired[0], thresholdx);
+            uint8_t codey = quantizeVecComponent(desired[1], thresholdy);
+            decoded = { float(codex), float(codey) };
+            toVecSpace(decoded[0], decoded[1]);
+
+            result.data[destOffset] = codex;
+            result.data[destOffset + 1] = codey;
+            result.data[destOffset + 2] = 0;
+        }
+        else
+        {
+            // only the error along the unit circle is carried, not the accumulated length
+            normalize(desired[0], desired[1]);
+            uint8_t angle = quantizeAngle(toDirectionAngle(desired[0], desired[1]), thresholdx);
+            angleToDir(angle, decoded[0], decoded[1]);
+            result.data[destOffset] = angle;
+            result.data[destOffset + 1] = strengthOf(x, y);
+            result.data[destOffset + 2] = 0;
+        }
+        return std::pair{ desired, decoded };
+    };
+
+    if (dither == Dither::eOrdered)
+    {
+        parallelFor(result.height, [&](size_t, size_t beginRow, size_t endRow) {
+            for (int y = int(beginRow); y < int(endRow); ++y)
+            {
+                for (int x = 0; x < result.width; ++x)
+                {
+                    // the transposed matrix decorrelates the two components
+                    quantize(x, y, target(x, y), orderedThreshold(x, y), orderedThreshold(y, x));
+                }
+            }
+        });
+    }
+    else
+    {
+        diffuseError(result.width, result.height, target, [&](int x, int y, std::array<float, 2>& desired) {
+            auto [quantized, decoded] = quantize(x, y, desired, 0.5f, 0.5f);
+            desired = quantized;
+            return decoded;
+        });
+    }
+
+    return result;
+}
+
+// False, with a message, when the output couldn't be written
+bool writeData(const std::string& inputfilename, const AnisotropyData& transformed, const ConversionOptions& options)
+{
+    std::string outputfilename = outputFilename(inputfilename, transformed.type, options);
+    if (outputfilename == "-")
+    {
+        // streamed out as it is deflated
+        if (options.format == OutputFormat::eRaw)
+        {
+            std::vector<uint8_t> raw = encodeRaw(transformed, options.mips);
+            fwrite(raw.data(), 1, raw.size(), stdout);
+        }
+        else
+        {
+            stbi_write_png_to_func([](void*, void* data, int size) { fwrite(data, 1, size_t(size), stdout); },
+                nullptr, transformed.width, transformed.height, transformed.numChannels, transformed.data.data(), transformed.width * transformed.numChannels);
+        }
+        if (fflush(stdout) != 0 || ferror(stdout))
+        {
+            std::cout << "Failed to write stdout" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool written = createParentDirectories(outputfilename);
+    if (written && options.format == OutputFormat::eRaw)
+    {
+        std::vector<uint8_t> raw = encodeRaw(transformed, options.mips);
+        std::ofstream file(outputfilename, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(raw.data()), raw.size());
+        file.close();
+        written = bool(file);
+    }
+    else if (written)
+    {
+        written = stbi_write_png(outputfilename.c_str(), transformed.width, transformed.height, transformed.numChannels, transformed.data.data(),
+            transformed.width * transformed.numChannels) != 0;
+    }
+    if (!written)
+    {
+        std::cout << "Failed to write " << outputfilename << std::endl;
+    }
+    return written;
+}
+
+// Output path without its extension; the -o path, or <inputfile>.[postfix] next to the input
+// or mirrored under --output-root
+std::string outputStem(const std::string& inputfilename, Type type, const ConversionOptions& options)
+{
+    if (!options.outputFile.empty())
+    {
+        return options.outputFile == "-" ? "stdout" : stripExt(options.outputFile);
+    }
+
+    std::unordered_map<Type, std::string> typeMapping = {
+        { Type::eOld3Channel, "3channel2" },
+        { Type::e3Channel, "3channel" },
+        { Type::e2D, "2D" },
+        { Type::eAngle, "angle" }
+    };
+
+    if (inputfilename == "-")
+    {
+        return std::format("stdin.{0}", typeMapping[type]);
+    }
+    if (options.outputRoot.empty())
+    {
+        return std::format("{0}.{1}", stripExt(inputfilename), typeMapping[type]);
+    }
+
+    // inputs outside the input root land directly in the output root
+    std::filesystem::path input = std::filesystem::absolute(inputfilename).lexically_normal();
+    std::filesystem::path relative = input.lexically_relative(std::filesystem::absolute(options.inputRoot).lexically_normal());
+    if (relative.empty() || *relative.begin() == "..")
+    {
+        relative = input.filename();
+    }
+    std::filesystem::path stem = std::filesystem::path(options.outputRoot) / relative.replace_extension();
+    return std::format("{0}.{1}", stem.string(), typeMapping[type]);
+}
+
+// "-" when the output goes to stdout
+std::string outputFilename(const std::string& inputfilename, Type type, const ConversionOptions& options)
+{
+    if (!options.outputFile.empty())
+    {
+        return options.outputFile;
+    }
+    if (inputfilename == "-")
+    {
+        return "-";
+    }
+
+    return std::format("{0}.{1}", outputStem(inputfilename, type, options), options.format == OutputFormat::eRaw ? "raw" : "png");
+}
+
+// Deepest directory containing every file
+std::string commonDirectory(const std::vector<std::string>& filenames)
+{
+    std::filesystem::path common = std::filesystem::absolute(filenames[0]).lexically_normal().parent_path();
+    for (const std::string& filename : filenames)
+    {
+        std::filesystem::path directory = std::filesystem::absolute(filename).lexically_normal().parent_path();
+        std::filesystem::path shared;
+        for (auto a = common.begin(), b = directory.begin(); a != common.end() && b != directory.end() && *a == *b; ++a, ++b)
+        {
+            shared /= *a;
+        }
+        common = shared;
+    }
+    return common.string();
+}
+
+// False when the directory the file goes in doesn't exist and couldn't be created
+bool createParentDirectories(const std::string& filename)
+{
+    std::filesystem::path parent = std::filesystem::path(filename).parent_path();
+    std::error_code error;
+    if (!parent.empty())
+    {
+        std::filesystem::create_directories(parent, error);
+    }
+    return !error;
+}
+
+// The output file encoded in memory, for callers that write the file themselves
+std::vector<uint8_t> encodeData(const AnisotropyData& transformed, const ConversionOptions& options)
+{
+    if (options.format == OutputFormat::eRaw)
+    {
+        return encodeRaw(transformed, options.mips);
+    }
+
+    std::vector<uint8_t> encoded;
+    stbi_write_png_to_func([](void* context, void* data, int size) {
+        std::vector<uint8_t>& out = *static_cast<std::vector<uint8_t>*>(context);
+        out.insert(out.end(), static_cast<uint8_t*>(data), static_cast<uint8_t*>(data) + size);
+    }, &encoded, transformed.width, transformed.height, transformed.numChannels, transformed.data.data(), transformed.width * transformed.numChannels);
+    return encoded;
+}
+
+// Decodes as the bytes arrive rather than buffering the whole stream. The first bytes are
+// read ahead to recognise a raw container, and replayed to stb_image otherwise.
+AnisotropyData loadDataFromStdin(Type anisotropyType)
+{
+    struct Stream
+    {
+        uint8_t prefix[sizeof(rawMagic)];
+        size_t prefixSize = 0;
+        size_t prefixRead = 0;
+    } stream;
+    stream.prefixSize = fread(stream.prefix, 1, sizeof(stream.prefix), stdin);
+
+    if (stream.prefixSize == sizeof(rawMagic) && memcmp(stream.prefix, rawMagic, sizeof(rawMagic)) == 0)
+    {
+        std::vector<uint8_t> bytes(stream.prefix, stream.prefix + stream.prefixSize);
+        uint8_t buffer[65536];
+        for (size_t n; (n = fread(buffer, 1, sizeof(buffer), stdin)) > 0;)
+        {
+            bytes.insert(bytes.end(), buffer, buffer + n);
+        }
+        if (bytes.size() < sizeof(RawHeader))
+        {
+            std::cout << "Failed to load stdin: truncated raw container" << std::endl;
+            return { .type = anisotropyType };
+        }
+        return decodeRaw("stdin", bytes.data(), bytes.size(), anisotropyType);
+    }
+
+    stbi_io_callbacks callbacks = {
+        .read = [](void* user, char* data, int size) {
+            Stream& stream = *static_cast<Stream*>(user);
+            int copied = 0;
+            while (stream.prefixRead < stream.prefixSize && copied < size)
+            {
+                data[copied++] = char(stream.prefix[stream.prefixRead++]);
+            }
+            return copied + int(fread(data + copied, 1, size_t(size - copied), stdin));
+        },
+        // pipes can't seek, so skipped bytes are read and dropped
+        .skip = [](void* user, int n) {
+            Stream& stream = *static_cast<Stream*>(user);
+            while (stream.prefixRead < stream.prefixSize && n > 0)
+            {
+                ++stream.prefixRead;
+                --n;
+            }
+            char buffer[4096];
+            while (n > 0)
+            {
+                size_t read = fread(buffer, 1, std::min<size_t>(size_t(n), sizeof(buffer)), stdin);
+                if (read == 0)
+                {
+                    break;
+                }
+                n -= int(read);
+            }
+        },
+        .eof = [](void* user) {
+            Stream& stream = *static_cast<Stream*>(user);
+            return int(stream.prefixRead == stream.prefixSize && feof(stdin));
+        }
+    };
+
+    int numChannels = 3;
+
+    int w, h, n;
+    unsigned char* input = stbi_load_from_callbacks(&callbacks, &stream, &w, &h, &n, numChannels);
+    if (!input)
+    {
+        std::cout << "Failed to load stdin: " << stbi_failure_reason() << std::endl;
+        return { .type = anisotropyType };
+    }
+
+    ImageBytes result(input, input + size_t(w) * h * numChannels);
+
+    stbi_image_free(input);
+
+    return { .data = std::move(result), .width = w, .height = h, .numChannels = numChannels, .type = anisotropyType };
+}
+
+// The anisotropy channels moved to options.packChannels, with the --pack-input channels
+// filled in around them, all in one pass over the output
+AnisotropyData packChannels(const std::string& inputfilename, const AnisotropyData& transformed, const ConversionOptions& options)
+{
+    AnisotropyData packed;
+    packed.width = transformed.width;
+    packed.height = transformed.height;
+    packed.type = transformed.type;
+    packed.numChannels = 3;
+    std::array<int, 4> source = { -1, -1, -1, -1 };
+    for (size_t i = 0; i < options.packChannels.size(); ++i)
+    {
+        int channel = int(std::string_view("rgba").find(options.packChannels[i]));
+        source[channel] = int(i);
+        packed.numChannels = std::max(packed.numChannels, channel + 1);
+    }
+
+    // extra inputs, loaded as RGBA so any of their channels can be picked
+    struct Loaded
+    {
+        std::unique_ptr<uint8_t, void (*)(void*)> pixels = { nullptr, stbi_image_free };
+        int sourceChannel = 0;
+    };
+    std::array<Loaded, 4> inputs;
+    for (const PackInput& input : options.packInputs)
+    {
+        std::string filename = input.filename;
+        for (size_t pos; (pos = filename.find("{stem}")) != std::string::npos;)
+        {
+            filename.replace(pos, 6, stripExt(inputfilename));
+        }
+        int w, h, n;
+        inputs[input.channel].pixels.reset(stbi_load(filename.c_str(), &w, &h, &n, 4));
+        inputs[input.channel].sourceChannel = input.sourceChannel;
+        if (!inputs[input.channel].pixels)
+        {
+            std::cout << "Failed to load " << filename << ": " << stbi_failure_reason() << std::endl;
+            return {};
+        }
+        if (w != transformed.width || h != transformed.height)
+        {
+            std::cout << std::format("Can't pack {0}: {1}x{2} does not match the {3}x{4} anisotropy texture\n", filename, w, h, transformed.width, transformed.height);
+            return {};
+        }
+        packed.numChannels = std::max(packed.numChannels, input.channel + 1);
+    }
+
+    size_t numPixels = size_t(packed.width) * packed.height;
+    packed.data.assign(numPixels * packed.numChannels, 0);
+    for (int c = 0; c < packed.numChannels; ++c)
+    {
+        uint8_t* dest = packed.data.data() + c;
+        if (source[c] >= 0)
+        {
+            const uint8_t* src = transformed.data.data() + source[c];
+            for (size_t i = 0; i < numPixels; ++i)
+            {
+                dest[i * packed.numChannels] = src[i * transformed.numChannels];
+            }
+        }
+        else if (inputs[c].pixels)
+        {
+            const uint8_t* src = inputs[c].pixels.get() + inputs[c].sourceChannel;
+            for (size_t i = 0; i < numPixels; ++i)
+            {
+                dest[i * packed.numChannels] = src[i * 4];
+            }
+        }
+    }
+    return packed;
+}
+
+// 2D and angle only use the first two channels, so the raw container drops the third
+int rawChannels(Type type)
+{
+    return (type == Type::e2D || type == Type::eAngle) ? 2 : 3;
+}
+
+std::vector<uint8_t> encodeRaw(const AnisotropyData& transformed, bool mips)
+{
+    std::vector<AnisotropyData> chain;
+    if (mips)
+    {
+        for (AnisotropyData level = downsample(transformed); ; level = downsample(chain.back()))
+        {
+            chain.push_back(std::move(level));
+            if ((chain.back().width == 1 && chain.back().height == 1) || chain.size() + 1 == RawHeader::maxLevels)
+            {
+                break;
+            }
+        }
+    }
+
+    std::vector<const AnisotropyData*> levels = { &transformed };
+    for (const AnisotropyData& level : chain)
+    {
+        levels.push_back(&level);
+    }
+    return encodeRawLevels(levels);
+}
+
+// A raw container of the given levels, largest first
+std::vector<uint8_t> encodeRawLevels(const std::vector<const AnisotropyData*>& levels)
+{
+    RawHeader header = {};
+    memcpy(header.magic, rawMagic, sizeof(rawMagic));
+    header.version = 1;
+    header.type = uint32_t(levels[0]->type);
+    header.numChannels = uint32_t(rawChannels(levels[0]->type));
+    header.numLevels = uint32_t(std::min<size_t>(levels.size(), RawHeader::maxLevels));
+
+    uint64_t offset = rawPageSize;
+    for (uint32_t level = 0; level < header.numLevels; ++level)
+    {
+        const AnisotropyData& image = *levels[level];
+        RawLevel& entry = header.levels[level];
+        entry.offset = offset;
+        entry.width = uint32_t(image.width);
+        entry.height = uint32_t(image.height);
+        entry.rowBytes = entry.width * header.numChannels;
+        offset += (uint64_t(entry.rowBytes) * entry.height + rawPageSize - 1) / rawPageSize * rawPageSize;
+    }
+
+    // padding between levels stays zero
+    std::vector<uint8_t> raw(offset);
+    memcpy(raw.data(), &header, sizeof(header));
+    for (uint32_t level = 0; level < header.numLevels; ++level)
+    {
+        const AnisotropyData& image = *levels[level];
+        uint8_t* dest = &raw[header.levels[level].offset];
+        size_t numPixels = size_t(image.width) * image.height;
+        for (size_t i = 0; i < numPixels; ++i)
+        {
+            memcpy(dest + i * header.numChannels, &image.data[i * image.numChannels], header.numChannels);
+        }
+    }
+    return raw;
+}
+
+// Whether a level of a container of <size> bytes has tightly packed rows, dimensions an int
+// can hold, and lies entirely inside the container; sizes are computed in 64 bits so corrupt
+// headers can't wrap around into passing
+bool rawLevelFits(const RawHeader& header, const RawLevel& level, uint64_t size)
+{
+    constexpr uint32_t maxDimension = uint32_t(std::numeric_limits<int>::max());
+    if (level.width == 0 || level.height == 0 || level.width > maxDimension || level.height > maxDimension
+        || uint64_t(level.rowBytes) != uint64_t(level.width) * header.numChannels)
+    {
+        return false;
+    }
+    return level.offset <= size && uint64_t(level.rowBytes) * level.height <= size - level.offset;
+}
+
+// Level 0 of a raw container, widened back to the 3 channels the conversions expect
+AnisotropyData decodeRaw(const std::string& filename, const uint8_t* bytes, size_t size, Type anisotropyType)
+{
+    RawHeader header;
+    memcpy(&header, bytes, sizeof(header));
+    const RawLevel& level = header.levels[0];
+    if (header.version != 1 || header.numLevels == 0 || header.numLevels > RawHeader::maxLevels || header.type > uint32_t(Type::eAngle)
+        || header.numChannels != uint32_t(rawChannels(Type(header.type))) || !rawLevelFits(header, level, size))
+    {
+        std::cout << "Failed to load " << filename << ": corrupt raw container" << std::endl;
+        return { .type = anisotropyType };
+    }
+
+    Type type = Type(header.type);
+    if (type != anisotropyType)
+    {
+        std::cout << filename << " is a raw container of another type, using the type it records" << std::endl;
+    }
+
+    AnisotropyData result = { .width = int(level.width), .height = int(level.height), .numChannels = 3, .type = type };
+    result.data.assign(size_t(result.width) * result.height * 3, 0);
+    const uint8_t* src = bytes + level.offset;
+    size_t numPixels = size_t(result.width) * result.height;
+    for (size_t i = 0; i < numPixels; ++i)
+    {
+        memcpy(&result.data[i * 3], src + i * header.numChannels, header.numChannels);
+    }
+    return result;
+}
+
+// Each pixel as its direction scaled by its strength, in [-1,1]. Anisotropy is filtered in
+// this space; averaging the encoded bytes would blend the 3channel direction and strength
+// independently and the angle encoding across its wrap around.
+std::vector<float> toStrengthVectors(const AnisotropyData& input)
+{
+    AnisotropyData new3;
+    const AnisotropyData* source = &input;
+    if (input.type == Type::eOld3Channel)
+    {
+        new3 = old3_to_new3(input);
+        source = &new3;
+    }
+
+    size_t numPixels = size_t(source->width) * source->height;
+    std::vector<float> vectors(numPixels * 2);
+    for (size_t i = 0; i < numPixels; ++i)
+    {
+        const uint8_t* pixel = &source->data[i * source->numChannels];
+        float x, y;
+        if (source->type == Type::eAngle)
+        {
+            angleToDir(pixel[0], x, y);
+            x *= pixel[1] / 255.f;
+            y *= pixel[1] / 255.f;
+        }
+        else
+        {
+            x = float(pixel[0]);
+            y = float(pixel[1]);
+            toVecSpace(x, y);
+            if (source->type == Type::e2D)
+            {
+                float magnitude = sqrt(x * x + y * y);
+                if (magnitude > 1.f)
+                {
+                    x /= magnitude;
+                    y /= magnitude;
+                }
+            }
+            else
+            {
+                normalize(x, y);
+                x *= pixel[2] / 255.f;
+                y *= pixel[2] / 255.f;
+            }
+        }
+        vectors[i * 2] = x;
+        vectors[i * 2 + 1] = y;
+    }
+    return vectors;
+}
+
+AnisotropyData fromStrengthVectors(const std::vector<float>& vectors, int width, int height, Type type)
+{
+    AnisotropyData result;
+    result.width = width;
+    result.height = height;
+    result.numChannels = 3;
+    result.type = type == Type::eOld3Channel ? Type::e3Channel : type;
+    result.data.resize(size_t(width) * height * 3);
+
+    size_t numPixels = size_t(width) * height;
+    for (size_t i = 0; i < numPixels; ++i)
+    {
+        float x = vectors[i * 2];
+        float y = vectors[i * 2 + 1];
+        float strength = std::min(sqrt(x * x + y * y), 1.f);
+        uint8_t* pixel = &result.data[i * 3];
+        if (result.type == Type::e2D)
+        {
+            if (strength > 0.f)
+            {
+                float scale = strength / sqrt(x * x + y * y);
+                x *= scale;
+                y *= scale;
+            }
+            toTexSpace(x, y);
+            pixel[0] = uint8_t(x * 255.f);
+            pixel[1] = uint8_t(y * 255.f);
+            pixel[2] = 0;
+        }
+        else if (result.type == Type::eAngle)
+        {
+            pixel[0] = directionToAngle(x, y);
+            pixel[1] = uint8_t(strength * 255.f);
+            pixel[2] = 0;
+        }
+        else
+        {
+            normalize(x, y);
+            toTexSpace(x, y);
+            pixel[0] = uint8_t(x * 255.f);
+            pixel[1] = uint8_t(y * 255.f);
+            pixel[2] = uint8_t(strength * 255.f);
+        }
+    }
+    return result;
+}
+
+// Half resolution by a 2x2 box; odd trailing rows and columns are dropped. <width> and
+// <height> are updated to the size of the result.
+std::vector<float> downsampleVectors(const std::vector<float>& source, int& width, int& height)
+{
+    int sourceWidth = width;
+    int sourceHeight = height;
+    width = std::max(1, sourceWidth / 2);
+    height = std::max(1, sourceHeight / 2);
+    std::vector<float> vectors(size_t(width) * height * 2);
+    for (int y = 0; y < height; ++y)
+    {
+        int y0 = std::min(y * 2, sourceHeight - 1);
+        int y1 = std::min(y * 2 + 1, sourceHeight - 1);
+        for (int x = 0; x < width; ++x)
+        {
+            int x0 = std::min(x * 2, sourceWidth - 1);
+            int x1 = std::min(x * 2 + 1, sourceWidth - 1);
+            for (int c = 0; c < 2; ++c)
+            {
+                float sum = source[(size_t(y0) * sourceWidth + x0) * 2 + c] + source[(size_t(y0) * sourceWidth + x1) * 2 + c]
+                    + source[(size_t(y1) * sourceWidth + x0) * 2 + c] + source[(size_t(y1) * sourceWidth + x1) * 2 + c];
+                vectors[(size_t(y) * width + x) * 2 + c] = sum * 0.25f;
+            }
+        }
+    }
+    return vectors;
+}
+
+// Half resolution by a 2x2 box in vector space
+AnisotropyData downsample(const AnisotropyData& input)
+{
+    int width = input.width;
+    int height = input.height;
+    std::vector<float> vectors = downsampleVectors(toStrengthVectors(input), width, height);
+    return fromStrengthVectors(vectors, width, height, input.type);
+}
+
+// Mip levels firstLevel..lastLevel of <loaded> as <outtype>, each quantized from vectors. The
+// first level below full resolution is box filtered straight from the input, converting only
+// the band of input rows under each output row, so the full resolution image is converted
+// just when level 0 is requested; the levels after it are filtered from its vectors.
+std::vector<AnisotropyData> convertLevels(const AnisotropyData& loaded, Type outtype, const ConversionOptions& options)
+{
+    std::vector<AnisotropyData> levels;
+    if (outtype == Type::eOld3Channel)
+    {
+        return levels;
+    }
+    if (options.firstLevel == 0)
+    {
+        levels.push_back(convertData(loaded, outtype, options));
+        if (levels.back().data.empty() || options.lastLevel == 0)
+        {
+            return levels;
+        }
+    }
+
+    // size of the first level needed and the block of input texels under each of its texels
+    int level = 0;
+    int width = loaded.width;
+    int height = loaded.height;
+    int blockWidth = 1;
+    int blockHeight = 1;
+    while (level < std::max(options.firstLevel, 1) && (width > 1 || height > 1))
+    {
+        blockWidth *= width > 1 ? 2 : 1;
+        blockHeight *= height > 1 ? 2 : 1;
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+        ++level;
+    }
+    if (level < options.firstLevel)
+    {
+        // the input has no such level; convertJob checks for this and says so
+        return {};
+    }
+    if (level == 0)
+    {
+        // a 1x1 input has no levels below it
+        return levels;
+    }
+
+    std::vector<float> vectors(size_t(width) * height * 2);
+    float scale = 1.f / float(blockWidth * blockHeight);
+    parallelFor(size_t(height), [&](size_t, size_t begin, size_t end) {
+        for (size_t y = begin; y < end; ++y)
+        {
+            std::vector<float> band = toStrengthVectors(sliceRows(loaded, int(y) * blockHeight, int(y + 1) * blockHeight));
+            for (int x = 0; x < width; ++x)
+            {
+                float sumX = 0.f;
+                float sumY = 0.f;
+                for (int row = 0; row < blockHeight; ++row)
+                {
+                    const float* texel = &band[(size_t(row) * loaded.width + size_t(x) * blockWidth) * 2];
+                    for (int column = 0; column < blockWidth; ++column)
+                    {
+                        sumX += texel[column * 2];
+                        sumY += texel[column * 2 + 1];
+                    }
+                }
+                vectors[(y * width + x) * 2] = sumX * scale;
+                vectors[(y * width + x) * 2 + 1] = sumY * scale;
+            }
+        }
+    });
+
+    while (true)
+    {
+        levels.push_back(fromStrengthVectors(vectors, width, height, outtype));
+        if (level == options.lastLevel || (width == 1 && height == 1))
+        {
+            break;
+        }
+        vectors = downsampleVectors(vectors, width, height);
+        ++level;
+    }
+    return levels;
+}
+
+// For each output texel along one axis, the first input texel it reads and the normalized
+// weights of it and the following ones; taps past the edges are folded onto the edge texels
+struct FilterTaps
+{
+    std::vector<int> first;
+    std::vector<int> count;
+    std::vector<float> weights;
+    int maxTaps = 0;
+};
+
+float filterWeight(ResizeFilter filter, float x)
+{
+    constexpr float pi = std::numbers::pi_v<float>;
+    x = std::abs(x);
+    auto sinc = [pi](float x) { return x < 1e-6f ? 1.f : sin(pi * x) / (pi * x); };
+    if (filter == ResizeFilter::eBox)
+    {
+        return x <= 0.5f ? 1.f : 0.f;
+    }
+    if (filter == ResizeFilter::eLanczos)
+    {
+        return x < 3.f ? sinc(x) * sinc(x / 3.f) : 0.f;
+    }
+
+    // a sinc of width 3 under a Kaiser window with alpha 4
+    auto bessel0 = [](float x) {
+        float sum = 1.f;
+        float term = 1.f;
+        for (int k = 1; k < 20; ++k)
+        {
+            term *= (x / (2.f * k)) * (x / (2.f * k));
+            sum += term;
+        }
+        return sum;
+    };
+    constexpr float width = 3.f;
+    constexpr float alpha = 4.f;
+    return x < width ? sinc(x) * bessel0(alpha * sqrt(1.f - (x / width) * (x / width))) / bessel0(alpha) : 0.f;
+}
+
+FilterTaps filterTaps(int inputSize, int outputSize, ResizeFilter filter)
+{
+    float scale = float(inputSize) / float(outputSize);
+    // when minifying the filter stretches over the input texels each output texel covers
+    float stretch = std::max(scale, 1.f);
+    float support = (filter == ResizeFilter::eBox ? 0.5f : 3.f) * stretch;
+
+    FilterTaps taps;
+    taps.first.resize(outputSize);
+    taps.count.resize(outputSize);
+    std::vector<std::vector<float>> rows(outputSize);
+    for (int o = 0; o < outputSize; ++o)
+    {
+        float center = (o + 0.5f) * scale - 0.5f;
+        int begin = int(std::ceil(center - support));
+        int end = int(std::floor(center + support));
+        int first = std::clamp(begin, 0, inputSize - 1);
+        int last = std::clamp(end, 0, inputSize - 1);
+        std::vector<float>& weights = rows[o];
+        weights.assign(last - first + 1, 0.f);
+        float sum = 0.f;
+        for (int i = begin; i <= end; ++i)
+        {
+            float weight = filterWeight(filter, (i - center) / stretch);
+            weights[std::clamp(i, 0, inputSize - 1) - first] += weight;
+            sum += weight;
+        }
+        if (sum == 0.f)
+        {
+            // nearest texel
+            weights.assign(1, 1.f);
+            first = std::clamp(int(std::lround(center)), 0, inputSize - 1);
+            sum = 1.f;
+        }
+        for (float& weight : weights)
+        {
+            weight /= sum;
+        }
+        taps.first[o] = first;
+        taps.count[o] = int(weights.size());
+        taps.maxTaps = std::max(taps.maxTaps, taps.count[o]);
+    }
+    taps.weights.assign(size_t(outputSize) * taps.maxTaps, 0.f);
+    for (int o = 0; o < outputSize; ++o)
+    {
+        std::copy(rows[o].begin(), rows[o].end(), taps.weights.begin() + size_t(o) * taps.maxTaps);
+    }
+    return taps;
+}
+
+// <loaded> resampled in vector space and quantized to <outtype> by truncation in one pass.
+// Bands of output rows are filtered in parallel; each band widens only the input rows under
+// it to vectors, filters them horizontally, then vertically into output rows that are
+// quantized straight away, so neither a converted nor a full vector image is kept.
+AnisotropyData resizeData(const AnisotropyData& loaded, Type outtype, const ConversionOptions& options)
+{
+    if (outtype == Type::eOld3Channel)
+    {
+        return {};
+    }
+    int width = options.resizeScale > 0.f ? std::max(1, int(std::lround(loaded.width * options.resizeScale))) : options.resizeWidth;
+    int height = options.resizeScale > 0.f ? std::max(1, int(std::lround(loaded.height * options.resizeScale))) : options.resizeHeight;
+    FilterTaps horizontal = filterTaps(loaded.width, width, options.filter);
+    FilterTaps vertical = filterTaps(loaded.height, height, options.filter);
+
+    AnisotropyData result;
+    result.width = width;
+    result.height = height;
+    result.numChannels = 3;
+    result.type = outtype;
+    result.data.resize(size_t(width) * height * 3);
+
+    constexpr int bandRows = 16;
+    size_t numBands = (size_t(height) + bandRows - 1) / bandRows;
+    parallelFor(numBands, [&](size_t, size_t beginBand, size_t endBand) {
+        std::vector<float> filtered;
+        std::vector<float> row(size_t(width) * 2);
+        for (size_t band = beginBand; band < endBand; ++band)
+        {
+            int beginRow = int(band) * bandRows;
+            int endRow = std::min(beginRow + bandRows, height);
+            int firstInput = vertical.first[beginRow];
+            int lastInput = vertical.first[endRow - 1] + vertical.count[endRow - 1] - 1;
+            for (int y = beginRow; y < endRow; ++y)
+            {
+                firstInput = std::min(firstInput, vertical.first[y]);
+                lastInput = std::max(lastInput, vertical.first[y] + vertical.count[y] - 1);
+            }
+
+            // the input rows of this band, filtered horizontally
+            std::vector<float> source = toStrengthVectors(sliceRows(loaded, firstInput, lastInput + 1));
+            filtered.assign(size_t(lastInput - firstInput + 1) * width * 2, 0.f);
+            for (int y = 0; y <= lastInput - firstInput; ++y)
+            {
+                const float* in = &source[size_t(y) * loaded.width * 2];
+                float* out = &filtered[size_t(y) * width * 2];
+                for (int x = 0; x < width; ++x)
+                {
+                    const float* weights = &horizontal.weights[size_t(x) * horizontal.maxTaps];
+                    const float* texel = in + size_t(horizontal.first[x]) * 2;
+                    float sumX = 0.f;
+                    float sumY = 0.f;
+                    for (int tap = 0; tap < horizontal.count[x]; ++tap)
+                    {
+                        sumX += weights[tap] * texel[tap * 2];
+                        sumY += weights[tap] * texel[tap * 2 + 1];
+                    }
+                    out[x * 2] = sumX;
+                    out[x * 2 + 1] = sumY;
+                }
+            }
+
+            for (int y = beginRow; y < endRow; ++y)
+            {
+                const float* weights = &vertical.weights[size_t(y) * vertical.maxTaps];
+                std::fill(row.begin(), row.end(), 0.f);
+                for (int tap = 0; tap < vertical.count[y]; ++tap)
+                {
+                    const float* in = &filtered[size_t(vertical.first[y] - firstInput + tap) * width * 2];
+                    for (int i = 0; i < width * 2; ++i)
+                    {
+                        row[i] += weights[tap] * in[i];
+                    }
+                }
+                AnisotropyData quantized = fromStrengthVectors(row, width, 1, outtype);
+                memcpy(&result.data[size_t(y) * width * 3], quantized.data.data(), size_t(width) * 3);
+            }
+        }
+    });
+    return result;
+}
+
+// <filename> with .mip<level> before its extension
+// Levels in the full mip chain of a <width>x<height> texture, down to 1x1
+int mipLevelCount(int width, int height)
+{
+    int count = 1;
+    for (int size = std::max(width, height); size > 1; size /= 2)
+    {
+        ++count;
+    }
+    return count;
+}
+
+std::string levelFilename(const std::string& filename, int level)
+{
+    std::filesystem::path path(filename);
+    std::string extension = path.extension().string();
+    return path.replace_extension().string() + std::format(".mip{0}{1}", level, extension);
+}
+
+
+
+
+// Round trips a block of 3channel inputs (packed as 0xXXYYSS) through the 2D encoding and
+// accumulates the angular and strength error against the original direction and strength.
+void analyzeBlock(const uint32_t* inputs, size_t count, const ConversionOptions& options, ErrorStats& stats)
+{
+    constexpr size_t blockSize = 256;
+    std::array<uint8_t, blockSize> x, y, s, encodedx, encodedy, decodedx, decodedy, decodeds;
+    std::array<float, blockSize> cosError;
+
+    for (size_t block = 0; block < count; block += blockSize)
+    {
+        size_t n = std::min(blockSize, count - block);
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint32_t input = inputs[block + i];
+            x[i] = uint8_t(input >> 16);
+            y[i] = uint8_t(input >> 8);
+            s[i] = uint8_t(input);
+        }
+
+        if (options.encoder == Encoder::eOptimal)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                std::tie(encodedx[i], encodedy[i]) = encodeMag2DOptimal(x[i], y[i], s[i]);
+            }
+        }
+        else
+        {
+            encodeMag2DBatch(x.data(), y.data(), s.data(), encodedx.data(), encodedy.data(), n);
+        }
+        decodeMag2DBatch(encodedx.data(), encodedy.data(), decodedx.data(), decodedy.data(), decodeds.data(), n);
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            float ax = (float(x[i]) / 255.f - 0.5f) * 2.f;
+            float ay = (float(y[i]) / 255.f - 0.5f) * 2.f;
+            float bx = (float(decodedx[i]) / 255.f - 0.5f) * 2.f;
+            float by = (float(decodedy[i]) / 255.f - 0.5f) * 2.f;
+            float lengths = sqrtf((ax * ax + ay * ay) * (bx * bx + by * by));
+            lengths = lengths > 0.f ? lengths : 1.f;
+            cosError[i] = std::clamp((ax * bx + ay * by) / lengths, -1.f, 1.f);
+        }
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint32_t input = inputs[block + i];
+            // direction is meaningless without any anisotropy strength
+            if (s[i] > 0)
+            {
+                float degrees = acos(cosError[i]) * (180.f / std::numbers::pi_v<float>);
+                stats.addAngle(degrees, input);
+            }
+            stats.addStrength(std::abs(float(s[i]) - float(decodeds[i])) / 255.f, input);
+        }
+    }
+}
+
+// seconds is omitted from the report when negative
+void writeAnalysisReport(const std::string& reportfilename, const std::string& source, const ErrorStats& stats, double seconds)
+{
+    std::ofstream report(reportfilename);
+    double angleMean = stats.angleCount ? stats.angleSum / double(stats.angleCount) : 0.0;
+    double angleRms = stats.angleCount ? std::sqrt(stats.angleSqSum / double(stats.angleCount)) : 0.0;
+    double strengthMean = stats.count ? stats.strengthSum / double(stats.count) : 0.0;
+    double strengthRms = stats.count ? std::sqrt(stats.strengthSqSum / double(stats.count)) : 0.0;
+    auto inputString = [](uint32_t input) {
+        return std::format("{0} {1} {2}", (input >> 16) & 0xff, (input >> 8) & 0xff, input & 0xff);
+    };
+
+    if (reportfilename.ends_with(".csv"))
+    {
+        report << "metric,value\n";
+        report << std::format("source,{0}\ninputs,{1}\n", source, stats.count);
+        if (seconds >= 0.0)
+        {
+            report << std::format("seconds,{0}\n", seconds);
+        }
+        if (stats.byteCount)
+        {
+            report << std::format("psnr_db,{0}\n", stats.psnr());
+        }
+        report << std::format("angle_mean_deg,{0}\nangle_rms_deg,{1}\nangle_p50_deg,{2}\nangle_p99_deg,{3}\nangle_max_deg,{4}\nangle_max_input,{5}\n",
+            angleMean, angleRms, stats.anglePercentile(0.5), stats.anglePercentile(0.99), stats.maxAngle, inputString(stats.maxAngleInput));
+        report << std::format("strength_mean,{0}\nstrength_rms,{1}\nstrength_p50,{2}\nstrength_p99,{3}\nstrength_max,{4}\nstrength_max_input,{5}\n",
+            strengthMean, strengthRms, stats.strengthPercentile(0.5), stats.strengthPercentile(0.99), stats.maxStrength, inputString(stats.maxStrengthInput));
+        report << "\nhistogram,bin_start,bin_end,count\n";
+        for (int i = 0; i < ErrorStats::angleBins; ++i)
+        {
+            if (stats.angleHistogram[i])
+            {
+                report << std::format("angle_deg,{0},{1},{2}\n", i / ErrorStats::angleBinsPerDegree, (i + 1) / ErrorStats::angleBinsPerDegree, stats.angleHistogram[i]);
+            }
+        }
+        for (int i = 0; i < ErrorStats::strengthBins; ++i)
+        {
+            if (stats.strengthHistogram[i])
+            {
+                report << std::format("strength_255ths,{0},{0},{1}\n", i, stats.strengthHistogram[i]);
+            }
+        }
+        return;
+    }
+
+    auto histogramString = [](const std::vector<uint64_t>& histogram) {
+        size_t last = histogram.size();
+        while (last > 0 && histogram[last - 1] == 0)
+        {
+            --last;
+        }
+        std::string result;
+        for (size_t i = 0; i < last; ++i)
+        {
+            result += std::format("{0}{1}", i ? ", " : "", histogram[i]);
+        }
+        return result;
+    };
+
+    report << "{\n";
+    report << std::format("  \"source\": {0},\n  \"inputs\": {1},\n", jsonQuoted(source), stats.count);
+    if (seconds >= 0.0)
+    {
+        report << std::format("  \"seconds\": {0},\n", seconds);
+    }
+    if (stats.byteCount)
+    {
+        // JSON has no infinity; a lossless round trip reports null
+        double psnr = stats.psnr();
+        report << std::format("  \"psnr\": {0},\n", std::isinf(psnr) ? std::string("null") : std::format("{0}", psnr));
+    }
+    report << std::format("  \"angle\": {{\n    \"units\": \"degrees\",\n    \"samples\": {0},\n    \"mean\": {1},\n    \"rms\": {2},\n    \"p50\": {3},\n    \"p90\": {4},\n    \"p99\": {5},\n    \"p999\": {6},\n    \"max\": {7},\n    \"maxInput\": \"{8}\",\n",
+        stats.angleCount, angleMean, angleRms, stats.anglePercentile(0.5), stats.anglePercentile(0.9), stats.anglePercentile(0.99), stats.anglePercentile(0.999), stats.maxAngle, inputString(stats.maxAngleInput));
+    report << std::format("    \"histogramBinWidth\": {0},\n    \"histogram\": [{1}]\n  }},\n", 1.f / ErrorStats::angleBinsPerDegree, histogramString(stats.angleHistogram));
+    report << std::format("  \"strength\": {{\n    \"units\": \"normalized\",\n    \"samples\": {0},\n    \"mean\": {1},\n    \"rms\": {2},\n    \"p50\": {3},\n    \"p90\": {4},\n    \"p99\": {5},\n    \"p999\": {6},\n    \"max\": {7},\n    \"maxInput\": \"{8}\",\n",
+        stats.count, strengthMean, strengthRms, stats.strengthPercentile(0.5), stats.strengthPercentile(0.9), stats.strengthPercentile(0.99), stats.strengthPercentile(0.999), stats.maxStrength, inputString(stats.maxStrengthInput));
+    report << std::format("    \"histogramBinWidth\": {0},\n    \"histogram\": [{1}]\n  }}\n", 1.f / 255.f, histogramString(stats.strengthHistogram));
+    report << "}\n";
+}
+
+int runAnalysis(const std::string& reportfilename, const std::string& texturefilename, Type textureType, const ConversionOptions& options)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // every 3channel input is a 24 bit code; either sweep them all or only those in the texture
+    std::vector<uint32_t> inputs;
+    if (texturefilename.empty())
+    {
+        inputs.resize(size_t(1) << 24);
+        for (uint32_t i = 0; i < inputs.size(); ++i)
+        {
+            inputs[i] = i;
+        }
+    }
+    else
+    {
+        AnisotropyData loaded = loadData(texturefilename, textureType);
+        if (loaded.data.empty())
+        {
+            return 1;
+        }
+        if (loaded.type == Type::eOld3Channel)
+        {
+            loaded = old3_to_new3(loaded);
+        }
+        else if (loaded.type != Type::e3Channel)
+        {
+            std::cout << "Analysis requires a 3channel or 3channel2 texture" << std::endl;
+            return 1;
+        }
+
+        std::vector<bool> present(size_t(1) << 24, false);
+        for (size_t offset = 0; offset < loaded.data.size(); offset += loaded.numChannels)
+        {
+            uint32_t input = (uint32_t(loaded.data[offset]) << 16) | (uint32_t(loaded.data[offset + 1]) << 8) | loaded.data[offset + 2];
+            if (!present[input])
+            {
+                present[input] = true;
+                inputs.push_back(input);
+            }
+        }
+    }
+
+    std::vector<ErrorStats> chunkStats(parallelChunks());
+    parallelFor(inputs.size(), [&](size_t chunk, size_t begin, size_t end) {
+        analyzeBlock(inputs.data() + begin, end - begin, options, chunkStats[chunk]);
+    });
+
+    ErrorStats stats;
+    for (const ErrorStats& chunk : chunkStats)
+    {
+        stats.merge(chunk);
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    writeAnalysisReport(reportfilename, texturefilename.empty() ? "all" : texturefilename, stats, seconds);
+
+    std::cout << std::format("Analyzed {0} inputs in {1:.2f}s: angle mean {2:.3f} max {3:.3f} deg, strength mean {4:.5f} max {5:.5f}\n",
+        stats.count, seconds, stats.angleCount ? stats.angleSum / double(stats.angleCount) : 0.0, stats.maxAngle,
+        stats.count ? stats.strengthSum / double(stats.count) : 0.0, stats.maxStrength);
+    return 0;
+}
+
+AnisotropyData convertWithRoundtrip(AnisotropyData loaded, Type outtype, const ConversionOptions& options, ErrorStats& stats, AnisotropyData& errorImage)
+{
+    if (loaded.type == Type::eOld3Channel)
+    {
+        loaded = old3_to_new3(loaded);
+    }
+    else if (loaded.type == Type::eAngle)
+    {
+        loaded = angle_to_new3(loaded);
+    }
+
+    bool supported = (loaded.type == Type::e3Channel && (outtype == Type::e2D || outtype == Type::eAngle || outtype == Type::e3Channel))
+        || (loaded.type == Type::e2D && (outtype == Type::eAngle || outtype == Type::e3Channel));
+    if (!supported)
+    {
+        return {};
+    }
+
+    AnisotropyData result;
+    result.width = loaded.width;
+    result.height = loaded.height;
+    result.numChannels = 3;
+    result.type = outtype;
+    result.data.resize(result.width * result.height * result.numChannels);
+
+    errorImage.width = loaded.width;
+    errorImage.height = loaded.height;
+    errorImage.numChannels = 3;
+    errorImage.type = outtype;
+    errorImage.data.resize(errorImage.width * errorImage.height * errorImage.numChannels);
+
+    // dithered outputs depend on their neighbours, so they are produced up front and only
+    // decoded here; every other output is encoded and decoded pixel by pixel in one pass
+    bool dithered = options.dither != Dither::eNone && outtype != Type::e3Channel && loaded.type != outtype;
+    if (dithered)
+    {
+        result = dither_to_mag2d_or_angle(loaded, outtype, options.dither);
+    }
+
+    std::vector<ErrorStats> chunkStats(parallelChunks());
+    parallelFor(loaded.height, [&](size_t chunk, size_t beginRow, size_t endRow) {
+        ErrorStats& rowStats = chunkStats[chunk];
+        for (size_t y = beginRow; y < endRow; ++y)
+        {
+            size_t offset = y * loaded.width * 3;
+            for (int x = 0; x < loaded.width; ++x, offset += 3)
+            {
+                const uint8_t* src = &loaded.data[offset];
+                uint8_t* dest = &result.data[offset];
+
+                // the input as a 3channel direction + strength is the reference
+                uint8_t reference[3] = { src[0], src[1], src[2] };
+                if (loaded.type == Type::e2D)
+                {
+                    decodeMag2D(src[0], src[1], reference[0], reference[1], reference[2]);
+                }
+
+                // encode the output, then decode it straight back to a 3channel direction + strength
+                uint8_t decoded[3];
+                float decodedx, decodedy;
+                if (outtype == Type::e2D)
+                {
+                    if (!dithered)
+                    {
+                        auto [encodedx, encodedy] = options.encoder == Encoder::eOptimal ? encodeMag2DOptimal(src[0], src[1], src[2]) : encodeMag2D(src[0], src[1], src[2]);
+                        dest[0] = encodedx;
+                        dest[1] = encodedy;
+                        dest[2] = 0;
+                    }
+                    decodeMag2D(dest[0], dest[1], decoded[0], decoded[1], decoded[2]);
+                    decodedx = float(decoded[0]);
+                    decodedy = float(decoded[1]);
+                    toVecSpace(decodedx, decodedy);
+                }
+                else if (outtype == Type::eAngle)
+                {
+                    if (!dithered)
+                    {
+                        float dirx = float(src[0]);
+                        float diry = float(src[1]);
+                        toVecSpace(dirx, diry);
+                        dest[0] = directionToAngle(dirx, diry);
+                        dest[1] = loaded.type == Type::e2D ? uint8_t(std::min(sqrt(dirx * dirx + diry * diry), 1.f) * 255.f) : src[2];
+                        dest[2] = 0;
+                    }
+
+                    angleToDir(dest[0], decodedx, decodedy);
+                    float texx = decodedx;
+                    float texy = decodedy;
+                    toTexSpace(texx, texy);
+                    decoded[0] = uint8_t(std::max(texx, 0.f) * 255.f);
+                    decoded[1] = uint8_t(std::max(texy, 0.f) * 255.f);
+                    decoded[2] = dest[1];
+                }
+                else
+                {
+                    dest[0] = reference[0];
+                    dest[1] = reference[1];
+                    dest[2] = reference[2];
+                    decoded[0] = reference[0];
+                    decoded[1] = reference[1];
+                    decoded[2] = reference[2];
+                    decodedx = float(decoded[0]);
+                    decodedy = float(decoded[1]);
+                    toVecSpace(decodedx, decodedy);
+                }
+
+                float referencex = float(reference[0]);
+                float referencey = float(reference[1]);
+                toVecSpace(referencex, referencey);
+                normalize(referencex, referencey);
+                normalize(decodedx, decodedy);
+
+                uint32_t input = (uint32_t(reference[0]) << 16) | (uint32_t(reference[1]) << 8) | reference[2];
+                float degrees = 0.f;
+                // direction is meaningless without any anisotropy strength
+                if (reference[2] > 0)
+                {
+                    float cosError = std::clamp(referencex * decodedx + referencey * decodedy, -1.f, 1.f);
+                    degrees = acos(cosError) * (180.f / std::numbers::pi_v<float>);
+                    rowStats.addAngle(degrees, input);
+                }
+                float strengthError = std::abs(float(reference[2]) - float(decoded[2])) / 255.f;
+                rowStats.addStrength(strengthError, input);
+                rowStats.addBytes(reference, decoded, 3);
+
+                uint8_t* error = &errorImage.data[offset];
+                error[0] = uint8_t(std::min(degrees * 10.f, 255.f));
+                error[1] = uint8_t(std::min(strengthError * 255.f * 16.f, 255.f));
+                error[2] = 0;
+            }
+        }
+    });
+
+    for (const ErrorStats& chunk : chunkStats)
+    {
+        stats.merge(chunk);
+    }
+
+    return result;
+}
+
+void writeRoundtripReport(const std::string& inputfilename, const AnisotropyData& transformed, const ErrorStats& stats, const AnisotropyData& errorImage, const ConversionOptions& options)
+{
+    std::string outputstem = outputStem(inputfilename, transformed.type, options);
+    createParentDirectories(outputstem);
+    stbi_write_png(std::format("{0}.error.png", outputstem).c_str(), errorImage.width, errorImage.height, errorImage.numChannels, errorImage.data.data(), errorImage.width * errorImage.numChannels);
+    writeAnalysisReport(std::format("{0}.roundtrip.json", outputstem), inputfilename, stats, -1.0);
+
+    std::cout << std::format("Round trip {0}: angle mean {1:.3f} p99 {2:.1f} max {3:.3f} deg, strength mean {4:.5f} p99 {5:.5f} max {6:.5f}, PSNR {7:.2f} dB\n",
+        outputstem, stats.angleCount ? stats.angleSum / double(stats.angleCount) : 0.0, stats.anglePercentile(0.99), stats.maxAngle,
+        stats.count ? stats.strengthSum / double(stats.count) : 0.0, stats.strengthPercentile(0.99), stats.maxStrength, stats.psnr());
+}
+
+// Bilinear sample of the raw texture channels in [0,1], as a GPU would before decoding
+void sampleBilinear(const AnisotropyData& texture, float u, float v, float* channels)
+{
+    float fx = u * texture.width - 0.5f;
+    float fy = v * texture.height - 0.5f;
+    int x0 = int(std::floor(fx));
+    int y0 = int(std::floor(fy));
+    float wx = fx - x0;
+    float wy = fy - y0;
+
+    // repeat wrapping
+    auto texel = [&](int x, int y, int c) {
+        x = ((x % texture.width) + texture.width) % texture.width;
+        y = ((y % texture.height) + texture.height) % texture.height;
+        return texture.data[(size_t(y) * texture.width + x) * texture.numChannels + c] / 255.f;
+    };
+
+    for (int c = 0; c < 3; ++c)
+    {
+        float top = texel(x0, y0, c) * (1.f - wx) + texel(x0 + 1, y0, c) * wx;
+        float bottom = texel(x0, y0 + 1, c) * (1.f - wx) + texel(x0 + 1, y0 + 1, c) * wx;
+        channels[c] = top * (1.f - wy) + bottom * wy;
+    }
+}
+
+// Tangent space anisotropy direction and strength from a filtered sample, following the
+// decoding in the README for the 2D encoding
+void decodeSample(Type type, const float* channels, float& dirx, float& diry, float& strength)
+{
+    if (type == Type::eAngle)
+    {
+        float twopi = 2.f * std::numbers::pi_v<float>;
+        float theta = -twopi * channels[0];
+        dirx = -sin(theta);
+        diry = cos(theta);
+        strength = channels[1];
+        return;
+    }
+
+    dirx = channels[0] * 2.f - 1.f;
+    diry = channels[1] * 2.f - 1.f;
+    if (type == Type::e2D)
+    {
+        strength = std::min(sqrt(dirx * dirx + diry * diry), 1.f);
+    }
+    else
+    {
+        strength = channels[2];
+    }
+    normalize(dirx, diry);
+    if (dirx == 0.f && diry == 0.f)
+    {
+        dirx = 1.f;
+        strength = 0.f;
+    }
+}
+
+// Per-pixel surface inputs for one row of the rendering, as structure of arrays so the
+// shading loop vectorizes
+struct ShadingRow
+{
+    std::vector<float> px, py, pz;
+    std::vector<float> nx, ny, nz;
+    std::vector<float> tx, ty, tz;
+    std::vector<float> bx, by, bz;
+    std::vector<float> dirx, diry, strength;
+    std::vector<float> mask;
+    std::vector<float> radiance;
+
+    explicit ShadingRow(int width)
+        : px(width), py(width), pz(width), nx(width), ny(width), nz(width), tx(width), ty(width), tz(width),
+          bx(width), by(width), bz(width), dirx(width), diry(width), strength(width), mask(width), radiance(width)
+    {
+    }
+};
+
+// Specular and diffuse response of a row of pixels to a point light, with the D_GGX_anisotropic,
+// V_GGX_anisotropic and specular_brdf_anisotropic terms from the README. Branch free, and
+// radiance is the only store and aliases no input, so the compiler can vectorize it.
+void shadeRow(const ShadingRow& row, float* __restrict radiance, int width, float alphaRoughness, const float* lightPos)
+{
+    constexpr float lightIntensity = 3.f;
+    constexpr float diffuseAlbedo = 0.1f;
+    constexpr float view[3] = { 0.f, 0.f, 1.f };
+    const float lightx = lightPos[0];
+    const float lighty = lightPos[1];
+    const float lightz = lightPos[2];
+
+    for (int i = 0; i < width; ++i)
+    {
+        float nx = row.nx[i], ny = row.ny[i], nz = row.nz[i];
+
+        // anisotropicT = normalize(TBN * direction), anisotropicB = normalize(cross(n, anisotropicT))
+        float tx = row.tx[i] * row.dirx[i] + row.bx[i] * row.diry[i];
+        float ty = row.ty[i] * row.dirx[i] + row.by[i] * row.diry[i];
+        float tz = row.tz[i] * row.dirx[i] + row.bz[i] * row.diry[i];
+        float tlen = std::max(sqrtf(tx * tx + ty * ty + tz * tz), 1e-8f);
+        tx /= tlen;
+        ty /= tlen;
+        tz /= tlen;
+        float bx = ny * tz - nz * ty;
+        float by = nz * tx - nx * tz;
+        float bz = nx * ty - ny * tx;
+        float blen = std::max(sqrtf(bx * bx + by * by + bz * bz), 1e-8f);
+        bx /= blen;
+        by /= blen;
+        bz /= blen;
+
+        float lx = lightx - row.px[i];
+        float ly = lighty - row.py[i];
+        float lz = lightz - row.pz[i];
+        float llen = std::max(sqrtf(lx * lx + ly * ly + lz * lz), 1e-8f);
+        lx /= llen;
+        ly /= llen;
+        lz /= llen;
+
+        float hx = lx + view[0];
+        float hy = ly + view[1];
+        float hz = lz + view[2];
+        float hlen = std::max(sqrtf(hx * hx + hy * hy + hz * hz), 1e-8f);
+        hx /= hlen;
+        hy /= hlen;
+        hz /= hlen;
+
+        float NdotL = std::clamp(nx * lx + ny * ly + nz * lz, 0.f, 1.f);
+        float NdotV = std::clamp(nx * view[0] + ny * view[1] + nz * view[2], 1e-4f, 1.f);
+        float NdotH = std::clamp(nx * hx + ny * hy + nz * hz, 1e-4f, 1.f);
+        float TdotV = tx * view[0] + ty * view[1] + tz * view[2];
+        float BdotV = bx * view[0] + by * view[1] + bz * view[2];
+        float TdotL = tx * lx + ty * ly + tz * lz;
+        float BdotL = bx * lx + by * ly + bz * lz;
+        float TdotH = tx * hx + ty * hy + tz * hz;
+        float BdotH = bx * hx + by * hy + bz * hz;
+
+        float anisotropy = std::clamp(row.strength[i], 0.f, 1.f);
+        float at = std::max(alphaRoughness * (1.f + anisotropy), 0.00001f);
+        float ab = std::max(alphaRoughness * (1.f - anisotropy), 0.00001f);
+
+        // V_GGX_anisotropic
+        float GGXV = NdotL * sqrtf(at * TdotV * at * TdotV + ab * BdotV * ab * BdotV + NdotV * NdotV);
+        float GGXL = NdotV * sqrtf(at * TdotL * at * TdotL + ab * BdotL * ab * BdotL + NdotL * NdotL);
+        float V = std::clamp(0.5f / std::max(GGXV + GGXL, 1e-8f), 0.f, 1.f);
+
+        // D_GGX_anisotropic
+        float a2 = at * ab;
+        float fx = ab * TdotH;
+        float fy = at * BdotH;
+        float fz = a2 * NdotH;
+        float w2 = a2 / std::max(fx * fx + fy * fy + fz * fz, 1e-20f);
+        float D = a2 * w2 * w2 / std::numbers::pi_v<float>;
+
+        float specular = V * D;
+        float diffuse = diffuseAlbedo / std::numbers::pi_v<float>;
+        radiance[i] = (specular + diffuse) * NdotL * lightIntensity * row.mask[i];
+    }
+}
+
+// Renders the decoded texture onto the chosen shape as an 8-bit grey image
+std::vector<uint8_t> renderAnisotropy(const AnisotropyData& texture, Type type, const RenderOptions& renderOptions)
+{
+    int size = renderOptions.size;
+    std::vector<uint8_t> image(size_t(size) * size);
+    float alphaRoughness = renderOptions.roughness * renderOptions.roughness;
+    // a light close over the plane sweeps highlights across it, the sphere is lit from afar
+    const float planeLight[3] = { 0.4f, 0.5f, 1.2f };
+    const float sphereLight[3] = { 2.f, 2.5f, 6.f };
+    const float* lightPos = renderOptions.shape == Shape::ePlane ? planeLight : sphereLight;
+
+    parallelFor(size, [&](size_t, size_t beginRow, size_t endRow) {
+        ShadingRow row(size);
+        for (size_t y = beginRow; y < endRow; ++y)
+        {
+            for (int x = 0; x < size; ++x)
+            {
+                // orthographic view of [-1,1]^2 looking down -z
+                float sx = (x + 0.5f) / size * 2.f - 1.f;
+                float sy = 1.f - (y + 0.5f) / size * 2.f;
+                float u, v;
+                if (renderOptions.shape == Shape::ePlane)
+                {
+                    row.px[x] = sx;
+                    row.py[x] = sy;
+                    row.pz[x] = 0.f;
+                    row.nx[x] = 0.f;
+                    row.ny[x] = 0.f;
+                    row.nz[x] = 1.f;
+                    row.tx[x] = 1.f;
+                    row.ty[x] = 0.f;
+                    row.tz[x] = 0.f;
+                    row.bx[x] = 0.f;
+                    row.by[x] = 1.f;
+                    row.bz[x] = 0.f;
+                    row.mask[x] = 1.f;
+                    u = (x + 0.5f) / size;
+                    v = (y + 0.5f) / size;
+                }
+                else
+                {
+                    // unit sphere at the origin with a longitude/latitude mapping
+                    float r2 = sx * sx + sy * sy;
+                    row.mask[x] = r2 <= 1.f ? 1.f : 0.f;
+                    float sz = sqrt(std::max(1.f - r2, 0.f));
+                    row.px[x] = sx;
+                    row.py[x] = sy;
+                    row.pz[x] = sz;
+                    row.nx[x] = sx;
+                    row.ny[x] = sy;
+                    row.nz[x] = sz;
+                    float tlen = std::max(sqrt(sz * sz + sx * sx), 1e-8f);
+                    row.tx[x] = sz / tlen;
+                    row.ty[x] = 0.f;
+                    row.tz[x] = -sx / tlen;
+                    // B = cross(N, T)
+                    row.bx[x] = sy * row.tz[x];
+                    row.by[x] = sz * row.tx[x] - sx * row.tz[x];
+                    row.bz[x] = -sy * row.tx[x];
+                    u = atan2(sx, sz) / (2.f * std::numbers::pi_v<float>) + 0.5f;
+                    v = acos(std::clamp(sy, -1.f, 1.f)) / std::numbers::pi_v<float>;
+                }
+
+                float channels[3];
+                sampleBilinear(texture, u, v, channels);
+                decodeSample(type, channels, row.dirx[x], row.diry[x], row.strength[x]);
+            }
+
+            shadeRow(row, row.radiance.data(), size, alphaRoughness, lightPos);
+
+            for (int x = 0; x < size; ++x)
+            {
+                // Reinhard tone map and gamma
+                float c = row.radiance[x];
+                c = std::pow(c / (1.f + c), 1.f / 2.2f);
+                image[y * size + x] = uint8_t(std::clamp(c * 255.f + 0.5f, 0.f, 255.f));
+            }
+        }
+    });
+
+    return image;
+}
+
+int runRender(const std::string& outputfilename, const std::vector<std::pair<std::string, Type>>& inputs, const RenderOptions& renderOptions)
+{
+    int size = renderOptions.size;
+    std::vector<std::vector<uint8_t>> renders;
+    for (const auto& [filename, type] : inputs)
+    {
+        AnisotropyData texture = loadData(filename, type);
+        if (texture.data.empty())
+        {
+            return 1;
+        }
+        if (texture.type == Type::eOld3Channel)
+        {
+            texture = old3_to_new3(texture);
+        }
+        renders.push_back(renderAnisotropy(texture, texture.type, renderOptions));
+    }
+
+    int width = size * int(renders.size());
+    std::vector<uint8_t> combined(size_t(width) * size);
+    for (size_t i = 0; i < renders.size(); ++i)
+    {
+        for (int y = 0; y < size; ++y)
+        {
+            memcpy(&combined[size_t(y) * width + i * size], &renders[i][size_t(y) * size], size);
+        }
+    }
+    stbi_write_png(outputfilename.c_str(), width, size, 1, combined.data(), width);
+
+    if (renders.size() < 2)
+    {
+        return 0;
+    }
+
+    std::vector<uint8_t> diff(size_t(size) * size);
+    double sqSum = 0.0;
+    int maxDiff = 0;
+    for (size_t i = 0; i < diff.size(); ++i)
+    {
+        int d = std::abs(int(renders[0][i]) - int(renders[1][i]));
+        sqSum += double(d) * d;
+        maxDiff = std::max(maxDiff, d);
+        diff[i] = uint8_t(std::min(d * 8, 255));
+    }
+    stbi_write_png(std::format("{0}.diff.png", stripExt(outputfilename)).c_str(), size, size, 1, diff.data(), size);
+
+    double rmse = std::sqrt(sqSum / double(diff.size()));
+    double psnr = rmse > 0.0 ? 20.0 * std::log10(255.0 / rmse) : std::numeric_limits<double>::infinity();
+    std::cout << std::format("Render difference: RMSE {0:.4f}, PSNR {1:.2f} dB, max {2}\n", rmse, psnr, maxDiff);
+
+    if (renderOptions.maxRmse >= 0.f && rmse > renderOptions.maxRmse)
+    {
+        std::cout << std::format("RMSE exceeds {0}\n", renderOptions.maxRmse);
+        return 1;
+    }
+    return 0;
+}
+
+// Time spent working, excluding waits on the queues, for one pipeline stage
+struct StageReport
+{
+    std::atomic<int64_t> busyMicroseconds = 0;
+    std::atomic<int> files = 0;
+
+    void add(std::chrono::steady_clock::time_point start)
+    {
+        busyMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        ++files;
+    }
+};
+
+int runPipeline(const std::vector<std::string>& filenames, Type inputtype, Type outtype, const ConversionOptions& options, const PipelineOptions& pipelineOptions)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // decode -> convert -> encode, so file N+1 is inflated while file N is converted and
+    // file N-1 deflated; the bounded queues keep a fast stage from running away with memory
+    BoundedQueue<FileJob> decoded(pipelineOptions.queueDepth);
+    BoundedQueue<FileJob> converted(pipelineOptions.queueDepth);
+    StageReport decodeReport, convertReport, encodeReport;
+    std::atomic<size_t> nextFile = 0;
+    std::atomic<int> failures = 0;
+    // files whose write fails on an I/O thread count as failed too
+    auto countFailedWrite = [&failures](bool ok) { failures += ok ? 0 : 1; };
+
+    // with async I/O the files are read ahead into memory, at most queueDepth at a time,
+    // and the decode threads inflate from there
+    std::optional<AsyncFileIO> io;
+    BoundedQueue<std::pair<std::string, std::vector<uint8_t>>> read(pipelineOptions.queueDepth);
+    std::counting_semaphore<> readSlots(pipelineOptions.queueDepth);
+    std::atomic<size_t> readsRemaining = filenames.size();
+    std::thread readStage;
+    if (pipelineOptions.io != IOBackend::eStdio)
+    {
+        io.emplace(pipelineOptions.io);
+        if (filenames.empty())
+        {
+            read.close();
+        }
+        readStage = std::thread([&]() {
+            for (const std::string& filename : filenames)
+            {
+                readSlots.acquire();
+                io->read(filename, [&, filename](std::vector<uint8_t>&& bytes, bool ok) {
+                    if (ok)
+                    {
+                        read.push({ filename, std::move(bytes) });
+                    }
+                    else
+                    {
+                        ++failures;
+                        readSlots.release();
+                    }
+                    if (--readsRemaining == 0)
+                    {
+                        read.close();
+                    }
+                });
+            }
+        });
+    }
+
+    // the stages are sized to share the cores between them, so a file's own parallelFor runs
+    // inline on its stage thread rather than starting a thread per core next to the others
+    auto runStage = [](int numThreads, auto&& body, auto&& done) {
+        std::vector<std::thread> threads;
+        for (int i = 0; i < numThreads; ++i)
+        {
+            threads.emplace_back([body]() mutable {
+                onPoolWorker = true;
+                body();
+            });
+        }
+        return std::thread([threads = std::move(threads), done]() mutable {
+            for (std::thread& thread : threads)
+            {
+                thread.join();
+            }
+            done();
+        });
+    };
+
+    std::thread decodeStage = runStage(pipelineOptions.decodeThreads, [&]() {
+        while (true)
+        {
+            FileJob job;
+            auto stageStart = std::chrono::steady_clock::now();
+            if (io)
+            {
+                std::optional<std::pair<std::string, std::vector<uint8_t>>> file = read.pop();
+                if (!file)
+                {
+                    break;
+                }
+                stageStart = std::chrono::steady_clock::now();
+                job.filename = file->first;
+                job.loaded = loadDataFromMemory(job.filename, file->second.data(), file->second.size(), inputtype);
+                file.reset();
+                readSlots.release();
+            }
+            else
+            {
+                size_t i = nextFile++;
+                if (i >= filenames.size())
+                {
+                    break;
+                }
+                job.filename = filenames[i];
+                job.loaded = loadData(job.filename, inputtype);
+            }
+            decodeReport.add(stageStart);
+            if (job.loaded.data.empty())
+            {
+                ++failures;
+                continue;
+            }
+            decoded.push(std::move(job));
+        }
+    }, [&]() { decoded.close(); });
+
+    std::thread convertStage = runStage(pipelineOptions.convertThreads, [&]() {
+        while (std::optional<FileJob> job = decoded.pop())
+        {
+            auto stageStart = std::chrono::steady_clock::now();
+            convertJob(*job, outtype, options);
+            convertReport.add(stageStart);
+            if (!hasOutput(*job))
+            {
+                std::cout << conversionFailure(*job) << std::endl;
+                ++failures;
+                continue;
+            }
+            converted.push(std::move(*job));
+        }
+    }, [&]() { converted.close(); });
+
+    std::thread encodeStage = runStage(pipelineOptions.encodeThreads, [&]() {
+        while (std::optional<FileJob> job = converted.pop())
+        {
+            auto stageStart = std::chrono::steady_clock::now();
+            if (!(io ? writeJobAsync(*job, options, *io, countFailedWrite) : writeJob(*job, options)))
+            {
+                ++failures;
+            }
+            encodeReport.add(stageStart);
+        }
+    }, []() {});
+
+    if (readStage.joinable())
+    {
+        readStage.join();
+    }
+    decodeStage.join();
+    convertStage.join();
+    encodeStage.join();
+    if (io)
+    {
+        io->drain();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::format("Pipeline: {0} files in {1:.3f}s, {2} failed, I/O {3}\n", filenames.size(), seconds, failures.load(), io ? io->backendName() : "stdio");
+    auto printStage = [&](const char* name, int threads, StageReport& report, const char* queue, size_t highWater) {
+        double busy = report.busyMicroseconds / 1e6;
+        std::cout << std::format("  {0:<8} {1} threads, {2} files, busy {3:.3f}s ({4:.0f}% of capacity){5}", name, threads, report.files.load(), busy,
+            100.0 * busy / std::max(seconds * threads, 1e-9), queue);
+        if (*queue)
+        {
+            std::cout << std::format(" {0} of {1}", highWater, pipelineOptions.queueDepth);
+        }
+        std::cout << "\n";
+    };
+    if (io)
+    {
+        std::cout << std::format("  read     read ahead peak {0} of {1}\n", read.highWater(), pipelineOptions.queueDepth);
+    }
+    printStage("decode", pipelineOptions.decodeThreads, decodeReport, ", output queue peak", decoded.highWater());
+    printStage("convert", pipelineOptions.convertThreads, convertReport, ", output queue peak", converted.highWater());
+    printStage("encode", pipelineOptions.encodeThreads, encodeReport, "", 0);
+
+    return failures ? 1 : 0;
+}
+
+// Rows [beginRow, endRow) of an image as an image of their own
+AnisotropyData sliceRows(const AnisotropyData& image, int beginRow, int endRow)
+{
+    AnisotropyData slice;
+    slice.width = image.width;
+    slice.height = endRow - beginRow;
+    slice.numChannels = image.numChannels;
+    slice.type = image.type;
+    size_t rowBytes = size_t(image.width) * image.numChannels;
+    slice.data.assign(image.data.begin() + beginRow * rowBytes, image.data.begin() + endRow * rowBytes);
+    return slice;
+}
+
+void copyRows(const AnisotropyData& slice, AnisotropyData& image, int beginRow)
+{
+    if (image.data.empty())
+    {
+        image.width = slice.width;
+        image.numChannels = slice.numChannels;
+        image.type = slice.type;
+        image.data.resize(size_t(image.width) * image.height * image.numChannels);
+    }
+    size_t rowBytes = size_t(slice.width) * slice.numChannels;
+    memcpy(&image.data[beginRow * rowBytes], slice.data.data(), slice.data.size());
+}
+
+int runWorkStealing(const std::vector<std::string>& filenames, Type inputtype, Type outtype, const ConversionOptions& options, const PipelineOptions& pipelineOptions)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // tiles of about this many pixels; whole multiples of 8 rows keep the ordered dither
+    // pattern identical to an untiled conversion
+    constexpr int64_t tilePixels = 256 * 1024;
+
+    // per file state shared by its tile tasks; the last tile to finish schedules the write
+    struct TiledJob
+    {
+        FileJob job;
+        std::mutex mutex;
+        std::atomic<int> remaining = 0;
+        bool failed = false;
+    };
+
+    std::vector<std::unique_ptr<TiledJob>> jobs;
+    std::atomic<int> failures = 0;
+    auto countFailedWrite = [&failures](bool ok) { failures += ok ? 0 : 1; };
+    std::atomic<int> tiles = 0;
+    {
+        // declared before the pool so that writes queued by its tasks outlive them
+        std::optional<AsyncFileIO> io;
+        if (pipelineOptions.io != IOBackend::eStdio)
+        {
+            io.emplace(pipelineOptions.io);
+        }
+        // files read into memory but not yet decoded, so reading ahead stays bounded
+        std::counting_semaphore<> readSlots(pipelineOptions.queueDepth);
+
+        // files are dealt to the nodes in turn; each is decoded, converted and encoded by the
+        // workers of its node, so its buffers are first touched and recycled there
+        std::vector<NumaNode> nodes;
+        if (pipelineOptions.numa)
+        {
+            nodes = numaTopology();
+        }
+        std::vector<std::atomic<uint64_t>> nodeFiles(std::max<size_t>(1, nodes.size()));
+        std::vector<std::atomic<uint64_t>> nodePixels(nodeFiles.size());
+
+        WorkStealingPool pool(pipelineOptions.workerThreads, nodes);
+        for (const std::string& filename : filenames)
+        {
+            int node = int(jobs.size() % nodeFiles.size());
+            jobs.push_back(std::make_unique<TiledJob>());
+            TiledJob* tiled = jobs.back().get();
+            tiled->job.filename = filename;
+
+            auto load = [&, tiled](std::vector<uint8_t> bytes) {
+                FileJob& job = tiled->job;
+                if (io)
+                {
+                    job.loaded = loadDataFromMemory(job.filename, bytes.data(), bytes.size(), inputtype);
+                    bytes = {};
+                    readSlots.release();
+                }
+                else
+                {
+                    job.loaded = loadData(job.filename, inputtype);
+                }
+                if (job.loaded.data.empty())
+                {
+                    ++failures;
+                    return;
+                }
+                ++nodeFiles[currentNumaNode];
+
+                // error diffusion carries error from row to row, mip levels and resizing filter
+                // across rows and incremental conversion tiles by itself, so those convert as
+                // one tile
+                int height = job.loaded.height;
+                int tileRows = height;
+                if (options.dither != Dither::eDiffusion && !options.levels && !options.resize && !options.incremental)
+                {
+                    tileRows = int(std::max<int64_t>(1, tilePixels / std::max(job.loaded.width, 1)));
+                    tileRows = std::min((tileRows + 7) / 8 * 8, height);
+                }
+                int numTiles = (height + tileRows - 1) / tileRows;
+                tiles += numTiles;
+                job.transformed.height = height;
+                job.errorImage.height = height;
+                tiled->remaining = numTiles;
+
+                for (int beginRow = 0; beginRow < height; beginRow += tileRows)
+                {
+                    int endRow = std::min(beginRow + tileRows, height);
+                    pool.submit([&, tiled, beginRow, endRow]() {
+                        FileJob& job = tiled->job;
+                        FileJob tile;
+                        tile.filename = job.filename;
+                        tile.loaded = sliceRows(job.loaded, beginRow, endRow);
+                        nodePixels[currentNumaNode] += uint64_t(tile.loaded.width) * tile.loaded.height;
+                        convertJob(tile, outtype, options);
+
+                        {
+                            std::lock_guard lock(tiled->mutex);
+                            if (!hasOutput(tile))
+                            {
+                                tiled->failed = true;
+                                job.error = tile.error;
+                            }
+                            else if (options.levels || options.resize || options.incremental)
+                            {
+                                // converted as one tile
+                                job = std::move(tile);
+                            }
+                            else
+                            {
+                                copyRows(tile.transformed, job.transformed, beginRow);
+                                if (options.roundtripReport)
+                                {
+                                    copyRows(tile.errorImage, job.errorImage, beginRow);
+                                    job.stats.merge(tile.stats);
+                                }
+                            }
+                        }
+
+                        if (--tiled->remaining > 0)
+                        {
+                            return;
+                        }
+
+                        job.loaded.data = {};
+                        if (tiled->failed)
+                        {
+                            std::cout << conversionFailure(job) << std::endl;
+                            ++failures;
+                            return;
+                        }
+                        pool.submit([&, tiled]() {
+                            if (!(io ? writeJobAsync(tiled->job, options, *io, countFailedWrite) : writeJob(tiled->job, options)))
+                            {
+                                ++failures;
+                            }
+                            // release the images as soon as the file is done
+                            tiled->job = FileJob();
+                        });
+                    });
+                }
+            };
+
+            if (!io)
+            {
+                pool.submit([load]() { load({}); }, node);
+                continue;
+            }
+            readSlots.acquire();
+            io->read(filename, [&, load](std::vector<uint8_t>&& bytes, bool ok) {
+                if (!ok)
+                {
+                    ++failures;
+                    readSlots.release();
+                    return;
+                }
+                pool.submit([load, bytes = std::move(bytes)]() mutable { load(std::move(bytes)); }, node);
+            });
+        }
+        if (io)
+        {
+            // every read has handed its file to the pool once this returns
+            io->drain();
+        }
+        pool.wait();
+        if (io)
+        {
+            io->drain();
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << std::format("Work stealing: {0} files in {1:.3f}s, {2} failed, {3} workers ran {4} tasks ({5} conversion tiles), {6} stolen, I/O {7}\n",
+            filenames.size(), seconds, failures.load(), pipelineOptions.workerThreads, pool.executed(), tiles.load(), pool.stolen(), io ? io->backendName() : "stdio");
+        if (!nodes.empty())
+        {
+            std::cout << std::format("NUMA: {0} nodes, workers {1}, {2} tasks stolen across nodes\n", nodes.size(), pool.pinned() ? "pinned" : "not pinned",
+                pool.stolenAcrossNodes());
+            for (size_t i = 0; i < nodes.size(); ++i)
+            {
+                std::cout << std::format("  node {0}: {1} cpus, {2} workers, {3} files, {4:.1f} Mpixel converted, {5:.1f} Mpixel/s\n", nodes[i].id,
+                    nodes[i].cpus.size(), pool.workersOnNode(int(i)), nodeFiles[i].load(), nodePixels[i] / 1e6, nodePixels[i] / 1e6 / seconds);
+            }
+        }
+    }
+
+    return failures ? 1 : 0;
+}
+
+// Just enough of a JSON document model to edit glTF files: members keep their order and
+// numbers keep the text they were written with, so untouched parts round trip unchanged
+struct JsonValue
+{
+    enum class Kind
+    {
+        eNull,
+        eBool,
+        eNumber,
+        eString,
+        eArray,
+        eObject
+    };
+
+    Kind kind = Kind::eNull;
+    bool boolean = false;
+    std::string text;
+    std::vector<JsonValue> array;
+    std::vector<std::pair<std::string, JsonValue>> object;
+
+    JsonValue* find(std::string_view key)
+    {
+        for (auto& [name, value] : object)
+        {
+            if (name == key)
+            {
+                return &value;
+            }
+        }
+        return nullptr;
+    }
+
+    // -1 unless this is a non-negative integer
+    int index() const
+    {
+        if (kind != Kind::eNumber || text.empty() || text.find_first_not_of("0123456789") != std::string::npos)
+        {
+            return -1;
+        }
+        return atoi(text.c_str());
+    }
+
+    static JsonValue string(std::string text)
+    {
+        JsonValue value;
+        value.kind = Kind::eString;
+        value.text = std::move(text);
+        return value;
+    }
+
+    static JsonValue number(int number)
+    {
+        JsonValue value;
+        value.kind = Kind::eNumber;
+        value.text = std::to_string(number);
+        return value;
+    }
+};
+
+struct JsonParser
+{
+    std::string_view text;
+    size_t pos = 0;
+    std::string error;
+
+    void skipSpace()
+    {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r'))
+        {
+            ++pos;
+        }
+    }
+
+    bool fail(const char* message)
+    {
+        if (error.empty())
+        {
+            error = std::format("{0} at offset {1}", message, pos);
+        }
+        return false;
+    }
+
+    bool literal(std::string_view word)
+    {
+        if (text.substr(pos, word.size()) != word)
+        {
+            return fail("unexpected token");
+        }
+        pos += word.size();
+        return true;
+    }
+
+    static void appendUtf8(std::string& out, uint32_t codepoint)
+    {
+        if (codepoint < 0x80)
+        {
+            out += char(codepoint);
+        }
+        else if (codepoint < 0x800)
+        {
+            out += char(0xc0 | (codepoint >> 6));
+            out += char(0x80 | (codepoint & 0x3f));
+        }
+        else if (codepoint < 0x10000)
+        {
+            out += char(0xe0 | (codepoint >> 12));
+            out += char(0x80 | ((codepoint >> 6) & 0x3f));
+            out += char(0x80 | (codepoint & 0x3f));
+        }
+        else
+        {
+            out += char(0xf0 | (codepoint >> 18));
+            out += char(0x80 | ((codepoint >> 12) & 0x3f));
+            out += char(0x80 | ((codepoint >> 6) & 0x3f));
+            out += char(0x80 | (codepoint & 0x3f));
+        }
+    }
+
+    bool hex4(uint32_t& value)
+    {
+        if (pos + 4 > text.size())
+        {
+            return fail("truncated escape");
+        }
+        value = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            char c = text[pos++];
+            int digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+            if (digit < 0)
+            {
+                return fail("bad escape");
+            }
+            value = value * 16 + uint32_t(digit);
+        }
+        return true;
+    }
+
+    bool string(std::string& out)
+    {
+        ++pos;
+        while (pos < text.size() && text[pos] != '"')
+        {
+            char c = text[pos++];
+            if (c != '\\')
+            {
+                out += c;
+                continue;
+            }
+            if (pos >= text.size())
+            {
+                break;
+            }
+            char escape = text[pos++];
+            switch (escape)
+            {
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u':
+            {
+                uint32_t codepoint = 0;
+                if (!hex4(codepoint))
+                {
+                    return false;
+                }
+                if (codepoint >= 0xdc00 && codepoint < 0xe000)
+                {
+                    return fail("unpaired surrogate");
+                }
+                if (codepoint >= 0xd800 && codepoint < 0xdc00)
+                {
+                    // a high surrogate must be followed by the escape of a low one
+                    uint32_t low = 0;
+                    if (text.substr(pos, 2) != "\\u")
+                    {
+                        return fail("unpaired surrogate");
+                    }
+                    pos += 2;
+                    if (!hex4(low))
+                    {
+                        return false;
+                    }
+                    if (low < 0xdc00 || low >= 0xe000)
+                    {
+                        return fail("unpaired surrogate");
+                    }
+                    codepoint = 0x10000 + ((codepoint - 0xd800) << 10) + (low - 0xdc00);
+                }
+                appendUtf8(out, codepoint);
+                break;
+            }
+            default: out += escape; break;
+            }
+        }
+        if (pos >= text.size())
+        {
+            return fail("unterminated string");
+        }
+        ++pos;
+        return true;
+    }
+
+    bool value(JsonValue& out, int depth)
+    {
+        if (depth > 256)
+        {
+            return fail("nested too deeply");
+        }
+        skipSpace();
+        if (pos >= text.size())
+        {
+            return fail("unexpected end");
+        }
+
+        char c = text[pos];
+        if (c == '{')
+        {
+            out.kind = JsonValue::Kind::eObject;
+            ++pos;
+            skipSpace();
+            if (pos < text.size() && text[pos] == '}')
+            {
+                ++pos;
+                return true;
+            }
+            while (true)
+            {
+                skipSpace();
+                std::string key;
+                if (pos >= text.size() || text[pos] != '"' || !string(key))
+                {
+                    return fail("expected a member name");
+                }
+                skipSpace();
+                if (pos >= text.size() || text[pos++] != ':')
+                {
+                    return fail("expected ':'");
+                }
+                out.object.emplace_back(std::move(key), JsonValue());
+                if (!value(out.object.back().second, depth + 1))
+                {
+                    return false;
+                }
+                skipSpace();
+                if (pos < text.size() && text[pos] == ',')
+                {
+                    ++pos;
+                    continue;
+                }
+                if (pos < text.size() && text[pos] == '}')
+                {
+                    ++pos;
+                    return true;
+                }
+                return fail("expected ',' or '}'");
+            }
+        }
+        if (c == '[')
+        {
+            out.kind = JsonValue::Kind::eArray;
+            ++pos;
+            skipSpace();
+            if (pos < text.size() && text[pos] == ']')
+            {
+                ++pos;
+                return true;
+            }
+            while (true)
+            {
+                out.array.emplace_back();
+                if (!value(out.array.back(), depth + 1))
+                {
+                    return false;
+                }
+                skipSpace();
+                if (pos < text.size() && text[pos] == ',')
+                {
+                    ++pos;
+                    continue;
+                }
+                if (pos < text.size() && text[pos] == ']')
+                {
+                    ++pos;
+                    return true;
+                }
+                return fail("expected ',' or ']'");
+            }
+        }
+        if (c == '"')
+        {
+            out.kind = JsonValue::Kind::eString;
+            return string(out.text);
+        }
+        if (c == 't' || c == 'f')
+        {
+            out.kind = JsonValue::Kind::eBool;
+            out.boolean = c == 't';
+            return literal(out.boolean ? "true" : "false");
+        }
+        if (c == 'n')
+        {
+            return literal("null");
+        }
+
+        size_t end = text.find_first_not_of("+-0123456789.eE", pos);
+        end = end == std::string_view::npos ? text.size() : end;
+        if (end == pos)
+        {
+            return fail("unexpected character");
+        }
+        out.kind = JsonValue::Kind::eNumber;
+        out.text = std::string(text.substr(pos, end - pos));
+        pos = end;
+        return true;
+    }
+};
+
+bool parseJson(std::string_view text, JsonValue& value, std::string& error)
+{
+    JsonParser parser{ .text = text };
+    if (parser.value(value, 0))
+    {
+        parser.skipSpace();
+        if (parser.pos == text.size())
+        {
+            return true;
+        }
+        parser.fail("trailing characters");
+    }
+    error = parser.error;
+    return false;
+}
+
+void writeJson(std::string& out, const JsonValue& value, int depth)
+{
+    auto newline = [&](int indent) {
+        out += '\n';
+        out.append(size_t(indent) * 2, ' ');
+    };
+    auto quoted = [&](const std::string& text) {
+        out += '"';
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += c;
+            }
+            else if (uint8_t(c) < 0x20)
+            {
+                out += std::format("\\u{0:04x}", int(c));
+            }
+            else
+            {
+                out += c;
+            }
+        }
+        out += '"';
+    };
+
+    switch (value.kind)
+    {
+    case JsonValue::Kind::eNull: out += "null"; break;
+    case JsonValue::Kind::eBool: out += value.boolean ? "true" : "false"; break;
+    case JsonValue::Kind::eNumber: out += value.text; break;
+    case JsonValue::Kind::eString: quoted(value.text); break;
+    case JsonValue::Kind::eArray:
+        out += '[';
+        for (size_t i = 0; i < value.array.size(); ++i)
+        {
+            out += i ? "," : "";
+            newline(depth + 1);
+            writeJson(out, value.array[i], depth + 1);
+        }
+        if (!value.array.empty())
+        {
+            newline(depth);
+        }
+        out += ']';
+        break;
+    case JsonValue::Kind::eObject:
+        out += '{';
+        for (size_t i = 0; i < value.object.size(); ++i)
+        {
+            out += i ? "," : "";
+            newline(depth + 1);
+            quoted(value.object[i].first);
+            out += ": ";
+            writeJson(out, value.object[i].second, depth + 1);
+        }
+        if (!value.object.empty())
+        {
+            newline(depth);
+        }
+        out += '}';
+        break;
+    }
+}
+
+// text as a JSON string literal, quotes and escapes included
+std::string jsonQuoted(const std::string& text)
+{
+    std::string out;
+    writeJson(out, JsonValue::string(text));
+    return out;
+}
+
+// glTF URIs are percent encoded; file names are not
+std::string decodeUri(const std::string& uri)
+{
+    std::string path;
+    for (size_t i = 0; i < uri.size(); ++i)
+    {
+        if (uri[i] == '%' && i + 2 < uri.size() && isxdigit(uint8_t(uri[i + 1])) && isxdigit(uint8_t(uri[i + 2])))
+        {
+            path += char(std::stoi(uri.substr(i + 1, 2), nullptr, 16));
+            i += 2;
+        }
+        else
+        {
+            path += uri[i];
+        }
+    }
+    return path;
+}
+
+std::string encodeUri(const std::string& path)
+{
+    std::string uri;
+    for (char c : path)
+    {
+        if (uint8_t(c) <= 0x20 || c == '%' || c == '#' || c == '?' || uint8_t(c) >= 0x7f)
+        {
+            uri += std::format("%{0:02X}", int(uint8_t(c)));
+        }
+        else
+        {
+            uri += c;
+        }
+    }
+    return uri;
+}
+
+// Every textureInfo ({ "index": n, ... } under a key ending in "Texture") in a material,
+// including those in extensions
+void collectTextureInfos(JsonValue& value, std::vector<std::pair<std::string, JsonValue*>>& infos)
+{
+    for (auto& [name, member] : value.object)
+    {
+        if (name.ends_with("Texture") && member.kind == JsonValue::Kind::eObject && member.find("index"))
+        {
+            infos.emplace_back(name, &member);
+        }
+        collectTextureInfos(member, infos);
+    }
+    for (JsonValue& element : value.array)
+    {
+        collectTextureInfos(element, infos);
+    }
+}
+
+int runGltf(const std::string& scenefilename, Type inputtype, Type outtype, const ConversionOptions& options, const PipelineOptions& pipelineOptions)
+{
+    std::ifstream file(scenefilename, std::ios::binary);
+    if (!file)
+    {
+        std::cout << "Failed to open " << scenefilename << std::endl;
+        return 1;
+    }
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (text.starts_with("glTF"))
+    {
+        std::cout << scenefilename << " is a binary .glb; only .gltf JSON scenes are supported" << std::endl;
+        return 1;
+    }
+
+    JsonValue scene;
+    std::string error;
+    if (!parseJson(text, scene, error))
+    {
+        std::cout << "Failed to parse " << scenefilename << ": " << error << std::endl;
+        return 1;
+    }
+
+    JsonValue* materials = scene.find("materials");
+    JsonValue* textures = scene.find("textures");
+    JsonValue* images = scene.find("images");
+    if (!materials || !textures || !images)
+    {
+        std::cout << scenefilename << " has no textured materials" << std::endl;
+        return 0;
+    }
+
+    // anisotropy texture references, and which textures are also used by other slots
+    std::vector<JsonValue*> anisotropyInfos;
+    std::vector<bool> usedElsewhere(textures->array.size());
+    for (JsonValue& material : materials->array)
+    {
+        std::vector<std::pair<std::string, JsonValue*>> infos;
+        collectTextureInfos(material, infos);
+        JsonValue* extensions = material.find("extensions");
+        JsonValue* anisotropy = extensions ? extensions->find("KHR_materials_anisotropy") : nullptr;
+        JsonValue* anisotropyTexture = anisotropy ? anisotropy->find("anisotropyTexture") : nullptr;
+        for (auto& [name, info] : infos)
+        {
+            int index = info->find("index")->index();
+            if (index < 0 || index >= int(textures->array.size()))
+            {
+                continue;
+            }
+            if (info == anisotropyTexture)
+            {
+                anisotropyInfos.push_back(info);
+            }
+            else
+            {
+                usedElsewhere[index] = true;
+            }
+        }
+    }
+
+    std::vector<bool> imageUsedElsewhere(images->array.size());
+    for (size_t i = 0; i < textures->array.size(); ++i)
+    {
+        JsonValue* source = textures->array[i].find("source");
+        int image = source ? source->index() : -1;
+        if (usedElsewhere[i] && image >= 0 && image < int(images->array.size()))
+        {
+            imageUsedElsewhere[image] = true;
+        }
+    }
+
+    // each distinct image file once, however many textures and materials share it
+    std::filesystem::path sceneDirectory = std::filesystem::absolute(scenefilename).parent_path();
+    std::vector<std::string> filenames;
+    std::unordered_map<std::string, size_t> fileIndex;
+    std::unordered_map<int, size_t> imageFile;
+    for (JsonValue* info : anisotropyInfos)
+    {
+        JsonValue* source = textures->array[info->find("index")->index()].find("source");
+        int image = source ? source->index() : -1;
+        if (image < 0 || image >= int(images->array.size()) || imageFile.contains(image))
+        {
+            continue;
+        }
+        JsonValue* uri = images->array[image].find("uri");
+        if (!uri || uri->kind != JsonValue::Kind::eString || uri->text.starts_with("data:"))
+        {
+            std::cout << "Skipping embedded image " << image << std::endl;
+            continue;
+        }
+        std::string path = (sceneDirectory / decodeUri(uri->text)).lexically_normal().string();
+        auto [it, inserted] = fileIndex.emplace(path, filenames.size());
+        if (inserted)
+        {
+            filenames.push_back(path);
+        }
+        imageFile[image] = it->second;
+    }
+    if (filenames.empty())
+    {
+        std::cout << scenefilename << " references no external anisotropy textures" << std::endl;
+        return 0;
+    }
+
+    // images follow the output location options; -o names the scene
+    ConversionOptions imageOptions = options;
+    imageOptions.outputFile.clear();
+    if (!imageOptions.outputRoot.empty() && imageOptions.inputRoot.empty())
+    {
+        std::vector<std::string> all = filenames;
+        all.push_back(std::filesystem::absolute(scenefilename).string());
+        imageOptions.inputRoot = commonDirectory(all);
+    }
+    ConversionOptions sceneOptions = imageOptions;
+    sceneOptions.outputFile = options.outputFile;
+    sceneOptions.format = OutputFormat::ePng;
+    std::string outputScene = std::format("{0}.gltf", outputStem(scenefilename, outtype, sceneOptions));
+    if (!options.outputFile.empty())
+    {
+        outputScene = options.outputFile;
+    }
+    if (imageOptions.format == OutputFormat::eRaw)
+    {
+        std::cout << "Note: raw containers are not glTF images; the rewritten scene is only usable by loaders that know them" << std::endl;
+    }
+
+    std::cout << std::format("{0}: {1} anisotropy texture references, {2} distinct images\n", scenefilename, anisotropyInfos.size(), filenames.size());
+    int result = pipelineOptions.scheduler == Scheduler::eWorkStealing
+        ? runWorkStealing(filenames, inputtype, outtype, imageOptions, pipelineOptions)
+        : runPipeline(filenames, inputtype, outtype, imageOptions, pipelineOptions);
+    if (result != 0)
+    {
+        std::cout << "Not writing " << outputScene << " as some images failed to convert" << std::endl;
+        return result;
+    }
+
+    // URIs in the rewritten scene are relative to wherever it is written
+    std::filesystem::path outputDirectory = std::filesystem::absolute(outputScene).parent_path();
+    auto relativeUri = [&](const std::filesystem::path& path) {
+        return encodeUri(std::filesystem::absolute(path).lexically_normal().lexically_relative(outputDirectory).generic_string());
+    };
+    for (const char* arrayName : { "buffers", "images" })
+    {
+        JsonValue* array = scene.find(arrayName);
+        if (!array)
+        {
+            continue;
+        }
+        for (JsonValue& element : array->array)
+        {
+            JsonValue* uri = element.find("uri");
+            if (uri && uri->kind == JsonValue::Kind::eString && !uri->text.starts_with("data:") && uri->text.find("://") == std::string::npos)
+            {
+                uri->text = relativeUri(sceneDirectory / decodeUri(uri->text));
+            }
+        }
+    }
+
+    // converted images replace the originals unless another slot still needs them
+    std::unordered_map<int, int> convertedImage;
+    for (auto [image, index] : imageFile)
+    {
+        JsonValue converted = images->array[image];
+        converted.find("uri")->text = relativeUri(outputFilename(filenames[index], outtype, imageOptions));
+        if (JsonValue* mimeType = converted.find("mimeType"))
+        {
+            mimeType->text = imageOptions.format == OutputFormat::eRaw ? "application/octet-stream" : "image/png";
+        }
+        if (imageUsedElsewhere[image])
+        {
+            images->array.push_back(std::move(converted));
+            convertedImage[image] = int(images->array.size() - 1);
+        }
+        else
+        {
+            images->array[image] = std::move(converted);
+            convertedImage[image] = image;
+        }
+    }
+
+    std::unordered_map<int, int> convertedTexture;
+    for (JsonValue* info : anisotropyInfos)
+    {
+        int texture = info->find("index")->index();
+        JsonValue* source = textures->array[texture].find("source");
+        auto image = convertedImage.find(source ? source->index() : -1);
+        if (image == convertedImage.end())
+        {
+            continue;
+        }
+        if (!convertedTexture.contains(texture))
+        {
+            if (usedElsewhere[texture])
+            {
+                JsonValue copy = textures->array[texture];
+                *copy.find("source") = JsonValue::number(image->second);
+                textures->array.push_back(std::move(copy));
+                convertedTexture[texture] = int(textures->array.size() - 1);
+            }
+            else
+            {
+                *source = JsonValue::number(image->second);
+                convertedTexture[texture] = texture;
+            }
+        }
+        *info->find("index") = JsonValue::number(convertedTexture[texture]);
+    }
+
+    std::string out;
+    writeJson(out, scene);
+    out += '\n';
+    createParentDirectories(outputScene);
+    std::ofstream output(outputScene, std::ios::binary);
+    output << out;
+    if (!output)
+    {
+        std::cout << "Failed to write " << outputScene << std::endl;
+        return 1;
+    }
+    std::cout << std::format("Wrote {0}\n", outputScene);
+    return 0;
+}
+
+// Copy of image grown to width x height by repeating its last row and column
+AnisotropyData padImage(const AnisotropyData& image, int width, int height)
+{
+    if (image.width == width && image.height == height)
+    {
+        return image;
+    }
+    AnisotropyData padded = image;
+    padded.width = width;
+    padded.height = height;
+    padded.data.resize(size_t(width) * height * image.numChannels);
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            size_t src = (size_t(std::min(y, image.height - 1)) * image.width + std::min(x, image.width - 1)) * image.numChannels;
+            memcpy(&padded.data[(size_t(y) * width + x) * image.numChannels], &image.data[src], image.numChannels);
+        }
+    }
+    return padded;
+}
+
+// Level `level` of every layer, one after the other, at texelBytes per texel; a fourth byte
+// is filled with 255
+std::vector<uint8_t> arrayLevel(const std::vector<std::vector<AnisotropyData>>& chains, size_t level, int texelBytes)
+{
+    std::vector<uint8_t> bytes;
+    for (const std::vector<AnisotropyData>& chain : chains)
+    {
+        const AnisotropyData& image = chain[level];
+        size_t numPixels = size_t(image.width) * image.height;
+        size_t offset = bytes.size();
+        bytes.resize(offset + numPixels * texelBytes, 255);
+        for (size_t i = 0; i < numPixels; ++i)
+        {
+            memcpy(&bytes[offset + i * texelBytes], &image.data[i * image.numChannels], std::min(texelBytes, image.numChannels));
+        }
+    }
+    return bytes;
+}
+
+bool writeKtx2(const std::string& filename, const std::vector<std::vector<AnisotropyData>>& chains, Type type)
+{
+    auto put32 = [](std::vector<uint8_t>& out, uint32_t value) {
+        for (int i = 0; i < 4; ++i)
+        {
+            out.push_back(uint8_t(value >> (i * 8)));
+        }
+    };
+    auto put64 = [&](std::vector<uint8_t>& out, uint64_t value) {
+        put32(out, uint32_t(value));
+        put32(out, uint32_t(value >> 32));
+    };
+
+    int texelBytes = rawChannels(type);
+    uint32_t numLevels = uint32_t(chains[0].size());
+
+    // basic data format descriptor: unsigned normalized linear channels, one sample each
+    std::vector<uint8_t> dfd;
+    uint32_t blockSize = 24 + 16 * texelBytes;
+    put32(dfd, 4 + blockSize);
+    put32(dfd, 0);
+    put32(dfd, 2 | (blockSize << 16));
+    put32(dfd, 1 | (1 << 8) | (1 << 16));
+    put32(dfd, 0);
+    put32(dfd, uint32_t(texelBytes));
+    put32(dfd, 0);
+    for (int c = 0; c < texelBytes; ++c)
+    {
+        put32(dfd, uint32_t(c * 8) | (7u << 16) | (uint32_t(c) << 24));
+        put32(dfd, 0);
+        put32(dfd, 0);
+        put32(dfd, 255);
+    }
+
+    std::vector<uint8_t> header = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+    put32(header, texelBytes == 2 ? 16 : 23); // VK_FORMAT_R8G8_UNORM, VK_FORMAT_R8G8B8_UNORM
+    put32(header, 1);
+    put32(header, uint32_t(chains[0][0].width));
+    put32(header, uint32_t(chains[0][0].height));
+    put32(header, 0);
+    put32(header, uint32_t(chains.size()));
+    put32(header, 1);
+    put32(header, numLevels);
+    put32(header, 0);
+
+    size_t indexEnd = header.size() + 4 * 4 + 2 * 8 + numLevels * 3 * 8;
+    put32(header, uint32_t(indexEnd));
+    put32(header, uint32_t(dfd.size()));
+    put32(header, 0);
+    put32(header, 0);
+    put64(header, 0);
+    put64(header, 0);
+
+    // levels are stored smallest first, each aligned to lcm(texel size, 4)
+    size_t alignment = texelBytes == 2 ? 4 : 12;
+    std::vector<std::vector<uint8_t>> levels(numLevels);
+    std::vector<uint64_t> offsets(numLevels);
+    uint64_t offset = indexEnd + dfd.size();
+    for (int level = int(numLevels) - 1; level >= 0; --level)
+    {
+        levels[level] = arrayLevel(chains, size_t(level), texelBytes);
+        offset = (offset + alignment - 1) / alignment * alignment;
+        offsets[level] = offset;
+        offset += levels[level].size();
+    }
+    for (uint32_t level = 0; level < numLevels; ++level)
+    {
+        put64(header, offsets[level]);
+        put64(header, levels[level].size());
+        put64(header, levels[level].size());
+    }
+
+    std::vector<uint8_t> file = std::move(header);
+    file.insert(file.end(), dfd.begin(), dfd.end());
+    for (int level = int(numLevels) - 1; level >= 0; --level)
+    {
+        file.resize(offsets[level], 0);
+        file.insert(file.end(), levels[level].begin(), levels[level].end());
+    }
+
+    std::ofstream out(filename, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(file.data()), file.size());
+    return bool(out);
+}
+
+bool writeDds(const std::string& filename, const std::vector<std::vector<AnisotropyData>>& chains, Type type)
+{
+    // DXGI has no 24 bit format, so 3channel layers get an opaque alpha
+    int texelBytes = rawChannels(type) == 2 ? 2 : 4;
+    uint32_t numLevels = uint32_t(chains[0].size());
+
+    std::array<uint32_t, 1 + 31 + 5> header = {};
+    header[0] = 0x20534444; // "DDS "
+    header[1] = 124;
+    header[2] = 0x1 | 0x2 | 0x4 | 0x8 | 0x1000 | (numLevels > 1 ? 0x20000 : 0);
+    header[3] = uint32_t(chains[0][0].height);
+    header[4] = uint32_t(chains[0][0].width);
+    header[5] = uint32_t(chains[0][0].width * texelBytes);
+    header[7] = numLevels;
+    header[19] = 32;
+    header[20] = 0x4;
+    header[21] = 0x30315844; // "DX10"
+    header[27] = 0x1000 | (numLevels > 1 ? 0x8 | 0x400000 : 0);
+    header[32] = texelBytes == 2 ? 49 : 28; // DXGI_FORMAT_R8G8_UNORM, DXGI_FORMAT_R8G8B8A8_UNORM
+    header[33] = 3;
+    header[35] = uint32_t(chains.size());
+
+    std::ofstream out(filename, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(header.data()), sizeof(header));
+    // each layer with its whole mip chain, then the next layer
+    for (const std::vector<AnisotropyData>& chain : chains)
+    {
+        for (uint32_t level = 0; level < numLevels; ++level)
+        {
+            std::vector<uint8_t> bytes = arrayLevel({ { chain[level] } }, 0, texelBytes);
+            out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        }
+    }
+    return bool(out);
+}
+
+int runArray(const std::string& outputfilename, const std::vector<std::string>& filenames, Type inputtype, Type outtype, const ConversionOptions& options,
+    const PipelineOptions& pipelineOptions, const ArrayOptions& arrayOptions)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::string extension = std::filesystem::path(outputfilename).extension().string();
+    bool atlas = extension == ".png";
+    if (!atlas && extension != ".ktx2" && extension != ".dds")
+    {
+        std::cout << "The array <outputfile> must end in .ktx2, .dds or .png" << std::endl;
+        return 1;
+    }
+
+    // convert every layer, larger ones split over the pool like any other batch
+    std::vector<FileJob> jobs(filenames.size());
+    std::vector<std::vector<AnisotropyData>> chains(filenames.size());
+    std::atomic<int> failures = 0;
+    {
+        WorkStealingPool pool(pipelineOptions.workerThreads);
+        for (size_t i = 0; i < filenames.size(); ++i)
+        {
+            pool.submit([&, i]() {
+                FileJob& job = jobs[i];
+                job.filename = filenames[i];
+                job.loaded = loadData(job.filename, inputtype);
+                if (job.loaded.data.empty())
+                {
+                    ++failures;
+                    return;
+                }
+                convertJob(job, outtype, options);
+                if (job.transformed.data.empty())
+                {
+                    std::cout << conversionFailure(job) << std::endl;
+                    ++failures;
+                    return;
+                }
+                if (options.roundtripReport)
+                {
+                    writeRoundtripReport(job.filename, job.transformed, job.stats, job.errorImage, options);
+                }
+            });
+        }
+        pool.wait();
+        if (failures)
+        {
+            std::cout << std::format("Not writing {0}: {1} of {2} inputs failed\n", outputfilename, failures.load(), filenames.size());
+            return 1;
+        }
+
+        if (!atlas)
+        {
+            int width = 0;
+            int height = 0;
+            for (const FileJob& job : jobs)
+            {
+                width = std::max(width, job.transformed.width);
+                height = std::max(height, job.transformed.height);
+            }
+            for (size_t i = 0; i < jobs.size(); ++i)
+            {
+                pool.submit([&, i]() {
+                    chains[i].push_back(padImage(jobs[i].transformed, width, height));
+                    while (options.mips && (chains[i].back().width > 1 || chains[i].back().height > 1))
+                    {
+                        chains[i].push_back(downsample(chains[i].back()));
+                    }
+                });
+            }
+            pool.wait();
+        }
+    }
+
+    // placement of each input: a layer, or a rectangle of the atlas
+    std::vector<std::array<int, 2>> positions(jobs.size());
+    int atlasWidth = 0;
+    int atlasHeight = 0;
+    bool written;
+    if (atlas)
+    {
+        // shelves of inputs sorted by height, in whichever power of two width wastes least
+        int padding = arrayOptions.padding;
+        int64_t area = 0;
+        int widest = 0;
+        for (const FileJob& job : jobs)
+        {
+            area += int64_t(job.transformed.width + 2 * padding) * (job.transformed.height + 2 * padding);
+            widest = std::max(widest, job.transformed.width + 2 * padding);
+        }
+
+        std::vector<size_t> order(jobs.size());
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return jobs[a].transformed.height > jobs[b].transformed.height; });
+        auto pack = [&](int width, std::vector<std::array<int, 2>>& placed) {
+            int x = 0;
+            int shelfY = 0;
+            int shelfHeight = 0;
+            for (size_t i : order)
+            {
+                const AnisotropyData& image = jobs[i].transformed;
+                if (x + image.width + 2 * padding > width)
+                {
+                    x = 0;
+                    shelfY += shelfHeight;
+                    shelfHeight = 0;
+                }
+                placed[i] = { x + padding, shelfY + padding };
+                x += image.width + 2 * padding;
+                shelfHeight = std::max(shelfHeight, image.height + 2 * padding);
+            }
+            return shelfY + shelfHeight;
+        };
+
+        int width = 1;
+        while (width < widest)
+        {
+            width *= 2;
+        }
+        int64_t bestArea = std::numeric_limits<int64_t>::max();
+        // wider than twice the square root of the area is only ever a longer single shelf
+        for (;; width *= 2)
+        {
+            std::vector<std::array<int, 2>> placed(jobs.size());
+            int height = pack(width, placed);
+            if (int64_t(width) * height < bestArea)
+            {
+                bestArea = int64_t(width) * height;
+                atlasWidth = width;
+                atlasHeight = height;
+                positions = std::move(placed);
+            }
+            if (int64_t(width) * width >= 4 * area)
+            {
+                break;
+            }
+        }
+
+        AnisotropyData result;
+        result.width = atlasWidth;
+        result.height = atlasHeight;
+        result.numChannels = 3;
+        result.type = outtype;
+        result.data.assign(size_t(atlasWidth) * atlasHeight * 3, 0);
+        parallelFor(jobs.size(), [&](size_t, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+            {
+                const AnisotropyData& image = jobs[i].transformed;
+                for (int y = -padding; y < image.height + padding; ++y)
+                {
+                    for (int x = -padding; x < image.width + padding; ++x)
+                    {
+                        size_t src = (size_t(std::clamp(y, 0, image.height - 1)) * image.width + std::clamp(x, 0, image.width - 1)) * image.numChannels;
+                        size_t dest = (size_t(positions[i][1] + y) * atlasWidth + positions[i][0] + x) * 3;
+                        memcpy(&result.data[dest], &image.data[src], 3);
+                    }
+                }
+            }
+        });
+        createParentDirectories(outputfilename);
+        written = stbi_write_png(outputfilename.c_str(), result.width, result.height, 3, result.data.data(), result.width * 3) != 0;
+    }
+    else
+    {
+        createParentDirectories(outputfilename);
+        written = extension == ".ktx2" ? writeKtx2(outputfilename, chains, outtype) : writeDds(outputfilename, chains, outtype);
+    }
+    if (!written)
+    {
+        std::cout << "Failed to write " << outputfilename << std::endl;
+        return 1;
+    }
+
+    std::unordered_map<Type, std::string> typeMapping = {
+        { Type::eOld3Channel, "3channel2" },
+        { Type::e3Channel, "3channel" },
+        { Type::e2D, "2D" },
+        { Type::eAngle, "angle" }
+    };
+    std::ofstream manifest(outputfilename + ".json");
+    manifest << "{\n";
+    manifest << std::format("  \"container\": {0},\n", jsonQuoted(std::filesystem::path(outputfilename).filename().string()));
+    manifest << std::format("  \"type\": \"{0}\",\n", typeMapping[outtype]);
+    if (atlas)
+    {
+        manifest << std::format("  \"width\": {0},\n  \"height\": {1},\n  \"padding\": {2},\n", atlasWidth, atlasHeight, arrayOptions.padding);
+    }
+    else
+    {
+        manifest << std::format("  \"width\": {0},\n  \"height\": {1},\n  \"layers\": {2},\n  \"levels\": {3},\n", chains[0][0].width, chains[0][0].height,
+            chains.size(), chains[0].size());
+    }
+    manifest << "  \"entries\": [\n";
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        const AnisotropyData& image = jobs[i].transformed;
+        int x = atlas ? positions[i][0] : 0;
+        int y = atlas ? positions[i][1] : 0;
+        float scaleU = 1.f / (atlas ? atlasWidth : chains[0][0].width);
+        float scaleV = 1.f / (atlas ? atlasHeight : chains[0][0].height);
+        manifest << std::format("    {{ \"source\": {0}, {1}\"x\": {2}, \"y\": {3}, \"width\": {4}, \"height\": {5}, \"uv\": [{6}, {7}, {8}, {9}] }}{10}\n",
+            jsonQuoted(filenames[i]), atlas ? "" : std::format("\"layer\": {0}, ", i), x, y, image.width, image.height,
+            x * scaleU, y * scaleV, (x + image.width) * scaleU, (y + image.height) * scaleV, i + 1 < jobs.size() ? "," : "");
+    }
+    manifest << "  ]\n}\n";
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::format("Array: {0} inputs into {1} in {2:.3f}s\n", filenames.size(), outputfilename, seconds);
+    return 0;
+}
+
+// Anonymous memory the kernel currently backs with transparent huge pages, -1 where unknown
+long long anonHugePagesKiB()
+{
+    std::ifstream file("/proc/self/smaps_rollup");
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.starts_with("AnonHugePages:"))
+        {
+            return atoll(line.c_str() + 14);
+        }
+    }
+    return -1;
+}
+
+int runBenchmark(const std::string& texturefilename, Type inputtype, Type outtype, const ConversionOptions& options, const BenchmarkOptions& benchmarkOptions)
+{
+    AnisotropyData source = loadData(texturefilename, inputtype);
+    if (source.data.empty())
+    {
+        return 1;
+    }
+    if (convertData(source, outtype, options).data.empty())
+    {
+        std::cout << "Unsupported conversion" << std::endl;
+        return 1;
+    }
+
+    int scale = benchmarkOptions.scale;
+    size_t rowBytes = size_t(source.width) * source.numChannels;
+    std::cout << std::format("Benchmark: {0}x{1} texels, {2} conversions per mode\n", source.width * scale, source.height * scale, benchmarkOptions.repeat);
+
+    const std::pair<HugePages, const char*> modes[] = {
+        { HugePages::eOff, "off" },
+        { HugePages::eTransparent, "thp" },
+        { HugePages::eExplicit, "explicit" }
+    };
+    for (const auto& [mode, name] : modes)
+    {
+        // start from an empty pool, so every buffer of this mode is freshly mapped and faulted in
+        trimBufferPool();
+        setHugePages(mode);
+
+        AnisotropyData input;
+        input.width = source.width * scale;
+        input.height = source.height * scale;
+        input.numChannels = source.numChannels;
+        input.type = source.type;
+        input.data.resize(rowBytes * scale * input.height);
+        parallelFor(size_t(input.height), [&](size_t, size_t begin, size_t end) {
+            for (size_t y = begin; y < end; ++y)
+            {
+                uint8_t* row = input.data.data() + y * rowBytes * scale;
+                const uint8_t* sourceRow = source.data.data() + (y % source.height) * rowBytes;
+                for (int tile = 0; tile < scale; ++tile)
+                {
+                    memcpy(row + tile * rowBytes, sourceRow, rowBytes);
+                }
+            }
+        });
+
+        std::vector<double> seconds;
+        long long hugeKiB = -1;
+        for (int run = 0; run < benchmarkOptions.repeat + 1; ++run)
+        {
+            AnisotropyData copy = input;
+            auto start = std::chrono::steady_clock::now();
+            AnisotropyData transformed = convertData(std::move(copy), outtype, options);
+            seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            if (run == 0)
+            {
+                hugeKiB = anonHugePagesKiB();
+            }
+        }
+
+        double megapixels = double(input.width) * input.height / 1e6;
+        // the first run faults the pages in; the rest reuse the pooled buffers
+        double best = seconds[1];
+        double mean = 0.0;
+        for (size_t run = 1; run < seconds.size(); ++run)
+        {
+            best = std::min(best, seconds[run]);
+            mean += seconds[run] / (seconds.size() - 1);
+        }
+        std::cout << std::format("  {0:<8} first {1:8.2f} Mpixel/s  best {2:8.2f} Mpixel/s  mean {3:8.2f} Mpixel/s  transparent huge pages {4}\n", name,
+            megapixels / seconds[0], megapixels / best, megapixels / mean, hugeKiB < 0 ? std::string("unknown") : std::format("{0} MiB", hugeKiB / 1024));
+    }
+    setHugePages(HugePages::eOff);
+    return 0;
+}
+
+// FNV-1a mixing over eight bytes at a time, which is much faster than FNV-1a itself but gives
+// different values; only for comparing with hashes made here, such as the tile sidecars
+uint64_t hashWords(const uint8_t* bytes, size_t size)
+{
+    constexpr uint64_t prime = 0x100000001b3ull;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * prime;
+    }
+    for (; i < size; ++i)
+    {
+        hash = (hash ^ bytes[i]) * prime;
+    }
+    return hash;
+}
+
+// Standard 64-bit FNV-1a, for hashes published to other tools
+uint64_t fnv1a64(const uint8_t* bytes, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Whether a file in a watched directory is an image to convert rather than one of our outputs,
+// which carry a type postfix such as .2D before their extension
+bool isWatchedImage(const std::filesystem::path& path)
+{
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return char(tolower(c)); });
+    if (extension != ".png" && extension != ".tga" && extension != ".jpg" && extension != ".jpeg" && extension != ".bmp" && extension != ".raw")
+    {
+        return false;
+    }
+    std::string name = path.filename().string();
+    for (std::string_view postfix : { ".3channel2.", ".3channel.", ".2D.", ".angle." })
+    {
+        if (name.find(postfix) != std::string::npos)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int runWatch(const std::vector<std::string>& inputs, Type inputtype, Type outtype, const ConversionOptions& options, const PipelineOptions& pipelineOptions)
+{
+#ifdef __linux__
+    // files saved in several writes settle before they are read
+    constexpr int debounceMs = 150;
+
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0)
+    {
+        std::cout << "--watch: inotify is unavailable" << std::endl;
+        return 1;
+    }
+
+    // watched directories, and the files watched in each; an empty set means all its images
+    std::unordered_map<int, std::string> directories;
+    std::unordered_map<std::string, std::vector<std::string>> watchedFiles;
+    std::vector<std::string> initial;
+    for (const std::string& input : inputs)
+    {
+        std::filesystem::path path = std::filesystem::absolute(input).lexically_normal();
+        std::error_code error;
+        bool isDirectory = std::filesystem::is_directory(path, error);
+        std::string directory = isDirectory ? path.string() : path.parent_path().string();
+        if (watchedFiles.find(directory) == watchedFiles.end())
+        {
+            int wd = inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+            if (wd < 0)
+            {
+                std::cout << "--watch: can't watch " << directory << std::endl;
+                close(fd);
+                return 1;
+            }
+            directories[wd] = directory;
+        }
+        std::vector<std::string>& files = watchedFiles[directory];
+        if (isDirectory)
+        {
+            files.clear();
+            files.push_back("");
+            for (const auto& entry : std::filesystem::directory_iterator(path, error))
+            {
+                if (entry.is_regular_file() && isWatchedImage(entry.path()))
+                {
+                    initial.push_back(entry.path().string());
+                }
+            }
+        }
+        else
+        {
+            if (files.empty() || !files[0].empty())
+            {
+                files.push_back(path.filename().string());
+            }
+            initial.push_back(path.string());
+        }
+    }
+
+    // the relative spelling the user gave is kept for output names where we have it
+    std::unordered_map<std::string, std::string> givenNames;
+    for (const std::string& input : inputs)
+    {
+        givenNames[std::filesystem::absolute(input).lexically_normal().string()] = input;
+    }
+
+    std::unordered_map<std::string, uint64_t> hashes;
+    std::mutex reportMutex;
+    WorkStealingPool pool(pipelineOptions.workerThreads);
+
+    // converts whichever of <changed> differ from what was last converted
+    auto convertChanged = [&](const std::vector<std::string>& changed) {
+        auto start = std::chrono::steady_clock::now();
+        int converted = 0;
+        for (const std::string& path : changed)
+        {
+            std::ifstream file(path, std::ios::binary);
+            std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            uint64_t hash = hashWords(bytes.data(), bytes.size());
+            if (bytes.empty() || (hashes.count(path) && hashes[path] == hash))
+            {
+                continue;
+            }
+            hashes[path] = hash;
+            ++converted;
+
+            auto name = givenNames.find(path);
+            std::string filename = name != givenNames.end() ? name->second : path;
+            pool.submit([&, filename, bytes = std::move(bytes)]() {
+                auto begin = std::chrono::steady_clock::now();
+                FileJob job;
+                job.filename = filename;
+                job.loaded = loadDataFromMemory(filename, bytes.data(), bytes.size(), inputtype);
+                if (job.loaded.data.empty())
+                {
+                    return;
+                }
+                auto loaded = std::chrono::steady_clock::now();
+                convertJob(job, outtype, options);
+                auto transformed = std::chrono::steady_clock::now();
+                if (!hasOutput(job))
+                {
+                    std::lock_guard lock(reportMutex);
+                    std::cout << conversionFailure(job) << std::endl;
+                    return;
+                }
+                if (!writeJob(job, options))
+                {
+                    return;
+                }
+                auto written = std::chrono::steady_clock::now();
+
+                auto ms = [](auto from, auto to) { return std::chrono::duration<double, std::milli>(to - from).count(); };
+                std::lock_guard lock(reportMutex);
+                std::cout << std::format("  {0}: decode {1:.1f} ms, convert {2:.1f} ms, encode {3:.1f} ms\n", filename, ms(begin, loaded),
+                    ms(loaded, transformed), ms(transformed, written));
+            });
+        }
+        pool.wait();
+        if (converted > 0)
+        {
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            std::cout << std::format("Converted {0} changed file{1} in {2:.1f} ms\n", converted, converted == 1 ? "" : "s", ms) << std::flush;
+        }
+    };
+
+    convertChanged(initial);
+    std::cout << std::format("Watching {0} director{1} for changes\n", directories.size(), directories.size() == 1 ? "y" : "ies") << std::flush;
+
+    alignas(inotify_event) char buffer[65536];
+    std::vector<std::string> changed;
+    while (true)
+    {
+        // block for the first event, then collect until the files are quiet
+        pollfd descriptor = { fd, POLLIN, 0 };
+        int ready = poll(&descriptor, 1, changed.empty() ? -1 : debounceMs);
+        if (ready < 0 && errno != EINTR)
+        {
+            break;
+        }
+        if (ready == 0)
+        {
+            std::sort(changed.begin(), changed.end());
+            changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+            convertChanged(changed);
+            changed.clear();
+            continue;
+        }
+
+        for (ssize_t length; (length = read(fd, buffer, sizeof(buffer))) > 0;)
+        {
+            for (char* next = buffer; next < buffer + length;)
+            {
+                const inotify_event* event = reinterpret_cast<const inotify_event*>(next);
+                next += sizeof(inotify_event) + event->len;
+                auto directory = directories.find(event->wd);
+                if (event->len == 0 || directory == directories.end())
+                {
+                    continue;
+                }
+                std::filesystem::path path = std::filesystem::path(directory->second) / event->name;
+                const std::vector<std::string>& files = watchedFiles[directory->second];
+                bool watched = !files.empty() && files[0].empty() ? isWatchedImage(path)
+                                                                   : std::find(files.begin(), files.end(), std::string(event->name)) != files.end();
+                if (watched)
+                {
+                    changed.push_back(path.string());
+                }
+            }
+        }
+    }
+    close(fd);
+    return 1;
+#else
+    std::cout << "--watch needs inotify, which is only available on Linux" << std::endl;
+    return 1;
+#endif
+}
+
+#ifdef ANISOTROPINATOR_MMAP
+// Line oriented messages over a stream socket
+struct SocketLines
+{
+    int fd = -1;
+    std::string buffer;
+
+    // false once the other end has closed and no whole line is left
+    bool readLine(std::string& line)
+    {
+        while (true)
+        {
+            size_t end = buffer.find('\n');
+            if (end != std::string::npos)
+            {
+                line = buffer.substr(0, end);
+                buffer.erase(0, end + 1);
+                return true;
+            }
+            char chunk[4096];
+            ssize_t length = read(fd, chunk, sizeof(chunk));
+            if (length < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (length <= 0)
+            {
+                return false;
+            }
+            buffer.append(chunk, size_t(length));
+        }
+    }
+
+    bool hasLine() const
+    {
+        return buffer.find('\n') != std::string::npos;
+    }
+
+    bool writeLine(const std::string& line)
+    {
+        std::string message = line + "\n";
+        for (size_t written = 0; written < message.size();)
+        {
+            ssize_t length = write(fd, message.data() + written, message.size() - written);
+            if (length < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (length <= 0)
+            {
+                return false;
+            }
+            written += size_t(length);
+        }
+        return true;
+    }
+};
+
+// A worker process: converts each file it is sent with the same load, convert and write steps
+// as a single file run and answers with how long each took, until told it is done.
+//   coordinator: JOB <index> <filename> | DONE
+//   worker:      RESULT <index> <ok> <decode ms> <convert ms> <write ms>
+void runShardWorker(int fd, Type inputtype, Type outtype, const ConversionOptions& options)
+{
+    SocketLines socket = { fd };
+    std::string line;
+    while (socket.readLine(line) && line.starts_with("JOB "))
+    {
+        size_t space = line.find(' ', 4);
+        int index = atoi(line.c_str() + 4);
+        auto start = std::chrono::steady_clock::now();
+        FileJob job;
+        job.filename = line.substr(space + 1);
+        job.loaded = loadData(job.filename, inputtype);
+        auto loaded = std::chrono::steady_clock::now();
+        bool ok = !job.loaded.data.empty();
+        if (ok)
+        {
+            convertJob(job, outtype, options);
+            ok = hasOutput(job);
+            if (!ok)
+            {
+                std::cout << conversionFailure(job) << std::endl;
+            }
+        }
+        auto transformed = std::chrono::steady_clock::now();
+        if (ok)
+        {
+            ok = writeJob(job, options);
+        }
+        auto written = std::chrono::steady_clock::now();
+        std::cout << std::flush;
+
+        auto ms = [](auto from, auto to) { return std::chrono::duration<double, std::milli>(to - from).count(); };
+        if (!socket.writeLine(std::format("RESULT {0} {1} {2:.3f} {3:.3f} {4:.3f}", index, ok ? 1 : 0, ms(start, loaded), ms(loaded, transformed), ms(transformed, written))))
+        {
+            return;
+        }
+    }
+}
+#endif
+
+int runSharded(const std::vector<std::string>& filenames, Type inputtype, Type outtype, const ConversionOptions& options, const PipelineOptions& pipelineOptions)
+{
+#ifdef ANISOTROPINATOR_MMAP
+    // a file that takes its worker down this many times is given up on
+    constexpr int maxAttempts = 3;
+    auto start = std::chrono::steady_clock::now();
+
+    struct ShardWorker
+    {
+        int number = 0;
+        pid_t pid = -1;
+        SocketLines socket;
+        int job = -1;
+        bool done = false;
+        bool crashed = false;
+        int files = 0;
+        int failed = 0;
+        double decodeMs = 0.0;
+        double convertMs = 0.0;
+        double writeMs = 0.0;
+    };
+    std::vector<std::unique_ptr<ShardWorker>> workers;
+    std::deque<int> queue;
+    for (int i = 0; i < int(filenames.size()); ++i)
+    {
+        queue.push_back(i);
+    }
+    std::vector<int> attempts(filenames.size(), 0);
+    int failures = 0;
+    int requeued = 0;
+
+    // workers are forked from this single threaded process and get their own copy of the options
+    signal(SIGPIPE, SIG_IGN);
+    auto spawn = [&]() {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        {
+            return false;
+        }
+        std::cout << std::flush;
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            close(fds[0]);
+            close(fds[1]);
+            return false;
+        }
+        if (pid == 0)
+        {
+            close(fds[0]);
+            for (const std::unique_ptr<ShardWorker>& worker : workers)
+            {
+                if (worker->socket.fd >= 0)
+                {
+                    close(worker->socket.fd);
+                }
+            }
+            runShardWorker(fds[1], inputtype, outtype, options);
+            std::cout << std::flush;
+            _exit(0);
+        }
+        close(fds[1]);
+        workers.push_back(std::make_unique<ShardWorker>());
+        workers.back()->number = int(workers.size());
+        workers.back()->pid = pid;
+        workers.back()->socket.fd = fds[0];
+        return true;
+    };
+
+    // hands the worker the next file, or tells it to finish
+    auto dispatch = [&](ShardWorker& worker) {
+        if (queue.empty())
+        {
+            worker.done = true;
+            worker.socket.writeLine("DONE");
+            return;
+        }
+        worker.job = queue.front();
+        queue.pop_front();
+        ++attempts[worker.job];
+        worker.socket.writeLine(std::format("JOB {0} {1}", worker.job, filenames[worker.job]));
+    };
+
+    int numProcesses = std::min(pipelineOptions.processes, int(filenames.size()));
+    for (int i = 0; i < numProcesses; ++i)
+    {
+        if (!spawn())
+        {
+            break;
+        }
+        dispatch(*workers.back());
+    }
+    if (workers.empty())
+    {
+        std::cout << "Failed to start worker processes" << std::endl;
+        return 1;
+    }
+
+    while (true)
+    {
+        std::vector<pollfd> descriptors;
+        std::vector<ShardWorker*> polled;
+        for (const std::unique_ptr<ShardWorker>& worker : workers)
+        {
+            if (worker->socket.fd >= 0)
+            {
+                descriptors.push_back({ worker->socket.fd, POLLIN, 0 });
+                polled.push_back(worker.get());
+            }
+        }
+        if (descriptors.empty())
+        {
+            break;
+        }
+        if (poll(descriptors.data(), descriptors.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        for (size_t i = 0; i < descriptors.size(); ++i)
+        {
+            if (descriptors[i].revents == 0)
+            {
+                continue;
+            }
+            ShardWorker& worker = *polled[i];
+            std::string line;
+            bool open = worker.socket.readLine(line);
+            while (open)
+            {
+                if (line.starts_with("RESULT ") && worker.job >= 0)
+                {
+                    int ok = 0;
+                    double decodeMs = 0.0, convertMs = 0.0, writeMs = 0.0;
+                    int index = -1;
+                    if (sscanf(line.c_str() + 7, "%d %d %lf %lf %lf", &index, &ok, &decodeMs, &convertMs, &writeMs) == 5 && index == worker.job)
+                    {
+                        ++worker.files;
+                        worker.failed += ok ? 0 : 1;
+                        failures += ok ? 0 : 1;
+                        worker.decodeMs += decodeMs;
+                        worker.convertMs += convertMs;
+                        worker.writeMs += writeMs;
+                    }
+                    worker.job = -1;
+                    dispatch(worker);
+                }
+                if (!worker.socket.hasLine())
+                {
+                    break;
+                }
+                open = worker.socket.readLine(line);
+            }
+            if (open)
+            {
+                continue;
+            }
+
+            // the worker has gone; one that wasn't told to finish died, and its file goes back
+            close(worker.socket.fd);
+            worker.socket.fd = -1;
+            int status = 0;
+            waitpid(worker.pid, &status, 0);
+            if (worker.done && worker.job < 0)
+            {
+                continue;
+            }
+            worker.crashed = true;
+            if (worker.job >= 0)
+            {
+                if (attempts[worker.job] < maxAttempts)
+                {
+                    queue.push_front(worker.job);
+                    ++requeued;
+                }
+                else
+                {
+                    std::cout << "Giving up on " << filenames[worker.job] << ": it took down " << maxAttempts << " workers" << std::endl;
+                    ++failures;
+                }
+                worker.job = -1;
+            }
+            if (!queue.empty() && spawn())
+            {
+                dispatch(*workers.back());
+            }
+        }
+    }
+
+    // files left when no worker could be started again
+    failures += int(queue.size());
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    int crashed = int(std::count_if(workers.begin(), workers.end(), [](const std::unique_ptr<ShardWorker>& worker) { return worker->crashed; }));
+    std::cout << std::format("Processes: {0} files in {1:.3f}s over {2} worker processes, {3} failed, {4} workers died, {5} files requeued\n", filenames.size(),
+        seconds, workers.size(), failures, crashed, requeued);
+    for (const std::unique_ptr<ShardWorker>& worker : workers)
+    {
+        std::cout << std::format("  worker {0} (pid {1}{2}): {3} files, {4} failed, decode {5:.1f} ms, convert {6:.1f} ms, write {7:.1f} ms\n", worker->number,
+            worker->pid, worker->crashed ? ", died" : "", worker->files, worker->failed, worker->decodeMs, worker->convertMs, worker->writeMs);
+    }
+    return failures ? 1 : 0;
+#else
+    std::cout << "--processes needs fork and local sockets, which this platform lacks" << std::endl;
+    return 1;
+#endif
+}
+
+// Sets a per entry option of a job manifest, named as its command line option without dashes;
+// false for unknown options and values
+bool applyJobOption(std::string_view name, std::string_view value, ConversionOptions& options)
+{
+    bool enabled = value == "true" || value == "1";
+    if (name == "encoder" && (value == "truncate" || value == "optimal"))
+    {
+        options.encoder = value == "truncate" ? Encoder::eTruncate : Encoder::eOptimal;
+    }
+    else if (name == "dither" && (value == "none" || value == "ordered" || value == "diffusion"))
+    {
+        options.dither = value == "none" ? Dither::eNone : value == "ordered" ? Dither::eOrdered : Dither::eDiffusion;
+    }
+    else if (name == "layout" && (value == "planar" || value == "interleaved"))
+    {
+        options.layout = value == "planar" ? Layout::ePlanar : Layout::eInterleaved;
+    }
+    else if (name == "format" && (value == "png" || value == "raw"))
+    {
+        options.format = value == "png" ? OutputFormat::ePng : OutputFormat::eRaw;
+    }
+    else if (name == "filter" && (value == "box" || value == "kaiser" || value == "lanczos"))
+    {
+        options.filter = value == "box" ? ResizeFilter::eBox : value == "kaiser" ? ResizeFilter::eKaiser : ResizeFilter::eLanczos;
+    }
+    else if (name == "mips")
+    {
+        options.mips = enabled;
+    }
+    else if (name == "roundtrip-report")
+    {
+        options.roundtripReport = enabled;
+    }
+    else if (name == "incremental")
+    {
+        options.incremental = enabled;
+    }
+    else if (name == "levels")
+    {
+        return parseLevels(value, options);
+    }
+    else if (name == "resize")
+    {
+        return parseResize(value, options);
+    }
+    else if (name == "output-root")
+    {
+        options.outputRoot = std::string(value);
+    }
+    else if (name == "input-root")
+    {
+        options.inputRoot = std::string(value);
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// Whitespace separated words of a line, where double quotes group words with spaces
+std::vector<std::string> splitWords(std::string_view line)
+{
+    std::vector<std::string> words;
+    size_t i = 0;
+    while (true)
+    {
+        i = line.find_first_not_of(" \t\r", i);
+        if (i == std::string_view::npos || line[i] == '#')
+        {
+            return words;
+        }
+        if (line[i] == '"')
+        {
+            size_t end = line.find('"', i + 1);
+            words.emplace_back(line.substr(i + 1, end == std::string_view::npos ? end : end - i - 1));
+            i = end == std::string_view::npos ? end : end + 1;
+            if (i == std::string_view::npos)
+            {
+                return words;
+            }
+            continue;
+        }
+        size_t end = line.find_first_of(" \t\r", i);
+        words.emplace_back(line.substr(i, end == std::string_view::npos ? end : end - i));
+        i = end;
+        if (i == std::string_view::npos)
+        {
+            return words;
+        }
+    }
+}
+
+int runManifest(const std::string& jobfilename, const std::string& resultfilename, const ConversionOptions& options, const PipelineOptions& pipelineOptions)
+{
+    if (!options.outputFile.empty())
+    {
+        std::cout << "-o names a single output, so it can't be used with a manifest" << std::endl;
+        return 1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::unordered_map<std::string, Type> typeMapping = {
+        { "3channel2", Type::eOld3Channel },
+        { "3channel", Type::e3Channel },
+        { "2D", Type::e2D },
+        { "angle", Type::eAngle }
+    };
+    std::unordered_map<Type, std::string> typeNames = {
+        { Type::eOld3Channel, "3channel2" },
+        { Type::e3Channel, "3channel" },
+        { Type::e2D, "2D" },
+        { Type::eAngle, "angle" }
+    };
+
+    std::ifstream file(jobfilename, std::ios::binary);
+    if (!file)
+    {
+        std::cout << "Failed to open " << jobfilename << std::endl;
+        return 1;
+    }
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    // one conversion of one input to one output type
+    struct ManifestOutput
+    {
+        std::string filename;
+        size_t size = 0;
+        uint64_t hash = 0;
+    };
+    struct ManifestJob
+    {
+        std::string input;
+        Type inputType = Type::e3Channel;
+        Type outputType = Type::e2D;
+        ConversionOptions options;
+        bool ok = false;
+        std::string error;
+        double decodeMs = 0.0;
+        double convertMs = 0.0;
+        double writeMs = 0.0;
+        std::vector<ManifestOutput> outputs;
+    };
+    std::vector<ManifestJob> jobs;
+    std::string error;
+    auto addEntry = [&](const std::string& input, const std::string& inputType, const std::vector<std::string>& outputTypes,
+                        const std::vector<std::pair<std::string, std::string>>& entryOptions, const std::string& where) {
+        ManifestJob job;
+        job.input = input;
+        job.options = options;
+        if (input.empty() || input == "-")
+        {
+            error = where + ": needs an input file";
+            return false;
+        }
+        if (typeMapping.find(inputType) == typeMapping.end())
+        {
+            error = where + ": unknown input type " + inputType;
+            return false;
+        }
+        job.inputType = typeMapping[inputType];
+        for (const auto& [name, value] : entryOptions)
+        {
+            if (!applyJobOption(name, value, job.options))
+            {
+                error = std::format("{0}: unknown option or value {1} {2}", where, name, value);
+                return false;
+            }
+        }
+        if (std::string conflict = optionConflicts(job.options); !conflict.empty())
+        {
+            error = where + ": " + conflict;
+            return false;
+        }
+        if (outputTypes.empty())
+        {
+            error = where + ": needs an output type";
+            return false;
+        }
+        for (const std::string& outputType : outputTypes)
+        {
+            if (typeMapping.find(outputType) == typeMapping.end())
+            {
+                error = where + ": unknown output type " + outputType;
+                return false;
+            }
+            job.outputType = typeMapping[outputType];
+            jobs.push_back(job);
+        }
+        return true;
+    };
+
+    size_t first = text.find_first_not_of(" \t\r\n");
+    if (first != std::string::npos && (text[first] == '{' || text[first] == '['))
+    {
+        JsonValue document;
+        if (!parseJson(text, document, error))
+        {
+            std::cout << "Failed to parse " << jobfilename << ": " << error << std::endl;
+            return 1;
+        }
+        JsonValue* entries = document.kind == JsonValue::Kind::eArray ? &document : document.find("jobs");
+        if (!entries || entries->kind != JsonValue::Kind::eArray)
+        {
+            std::cout << jobfilename << " has no jobs array" << std::endl;
+            return 1;
+        }
+        for (size_t i = 0; i < entries->array.size(); ++i)
+        {
+            JsonValue& entry = entries->array[i];
+            auto member = [&](std::string_view key) {
+                JsonValue* value = entry.find(key);
+                return value && value->kind == JsonValue::Kind::eString ? value->text : std::string();
+            };
+            std::vector<std::string> outputTypes;
+            if (JsonValue* types = entry.find("outputTypes"); types && types->kind == JsonValue::Kind::eArray)
+            {
+                for (const JsonValue& type : types->array)
+                {
+                    outputTypes.push_back(type.text);
+                }
+            }
+            else if (!member("outputType").empty())
+            {
+                outputTypes.push_back(member("outputType"));
+            }
+            std::vector<std::pair<std::string, std::string>> entryOptions;
+            if (JsonValue* values = entry.find("options"); values && values->kind == JsonValue::Kind::eObject)
+            {
+                for (const auto& [name, value] : values->object)
+                {
+                    entryOptions.emplace_back(name, value.kind == JsonValue::Kind::eBool ? (value.boolean ? "true" : "false") : value.text);
+                }
+            }
+            std::string inputType = member("inputType").empty() ? "3channel" : member("inputType");
+            if (!addEntry(member("input"), inputType, outputTypes, entryOptions, std::format("{0}: job {1}", jobfilename, i)))
+            {
+                std::cout << error << std::endl;
+                return 1;
+            }
+        }
+    }
+    else
+    {
+        std::istringstream lines(text);
+        std::string line;
+        for (int number = 1; std::getline(lines, line); ++number)
+        {
+            std::vector<std::string> words = splitWords(line);
+            if (words.empty())
+            {
+                continue;
+            }
+            std::string where = std::format("{0}:{1}", jobfilename, number);
+            std::vector<std::string> outputTypes;
+            std::vector<std::pair<std::string, std::string>> entryOptions;
+            if (words.size() >= 3)
+            {
+                for (size_t begin = 0, end; begin <= words[2].size(); begin = end + 1)
+                {
+                    end = std::min(words[2].find(',', begin), words[2].size());
+                    outputTypes.push_back(words[2].substr(begin, end - begin));
+                }
+                for (size_t i = 3; i < words.size(); ++i)
+                {
+                    // --<name> <value>, or a lone --<name> for switches
+                    std::string name = words[i].starts_with("--") ? words[i].substr(2) : words[i];
+                    bool hasValue = i + 1 < words.size() && !words[i + 1].starts_with("--");
+                    entryOptions.emplace_back(name, hasValue ? words[++i] : "true");
+                }
+            }
+            if (!addEntry(words[0], words.size() >= 2 ? words[1] : "", outputTypes, entryOptions, where))
+            {
+                std::cout << error << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    // --output-root mirrors below the deepest directory holding every input, as for batches
+    std::vector<std::string> inputs;
+    for (const ManifestJob& job : jobs)
+    {
+        inputs.push_back(job.input);
+    }
+    for (ManifestJob& job : jobs)
+    {
+        if (!job.options.outputRoot.empty() && job.options.inputRoot.empty())
+        {
+            job.options.inputRoot = commonDirectory(inputs);
+        }
+    }
+
+    // two conversions writing one file would race. Paths are compared normalized, and PNG
+    // levels claim a range of .mip<n> files, as where "end" lands depends on the input size.
+    auto normalized = [](const std::string& path) { return std::filesystem::absolute(path).lexically_normal().string(); };
+    struct OutputClaim
+    {
+        const ManifestJob* job;
+        int firstLevel;
+        int lastLevel;
+    };
+    std::unordered_map<std::string, std::vector<OutputClaim>> claims;
+    for (const ManifestJob& job : jobs)
+    {
+        std::string output = outputFilename(job.input, job.outputType, job.options);
+        std::vector<std::pair<std::string, OutputClaim>> files;
+        if (job.options.levels && job.options.format == OutputFormat::ePng)
+        {
+            int lastLevel = job.options.lastLevel < 0 ? std::numeric_limits<int>::max() : job.options.lastLevel;
+            files.push_back({ output, { &job, job.options.firstLevel, lastLevel } });
+        }
+        else
+        {
+            files.push_back({ output, { &job, -1, -1 } });
+        }
+        if (job.options.roundtripReport)
+        {
+            std::string stem = outputStem(job.input, job.outputType, job.options);
+            files.push_back({ stem + ".error.png", { &job, -1, -1 } });
+            files.push_back({ stem + ".roundtrip.json", { &job, -1, -1 } });
+        }
+        for (const auto& [file, claim] : files)
+        {
+            for (const OutputClaim& other : claims[normalized(file)])
+            {
+                if (claim.firstLevel > other.lastLevel || other.firstLevel > claim.lastLevel)
+                {
+                    continue;
+                }
+                std::string written = claim.firstLevel < 0 ? file : levelFilename(file, std::max(claim.firstLevel, other.firstLevel));
+                if (normalized(other.job->input) == normalized(job.input))
+                {
+                    std::cout << std::format("{0}: {1} is written by two conversions of {2}", jobfilename, written, job.input) << std::endl;
+                }
+                else
+                {
+                    std::cout << std::format("{0}: {1} is written by conversions of both {2} and {3}", jobfilename, written, other.job->input, job.input) << std::endl;
+                }
+                return 1;
+            }
+            claims[normalized(file)].push_back(claim);
+        }
+    }
+
+    // each input is decoded once, by the first of its conversions to run, and shared by the rest
+    struct DecodedInput
+    {
+        std::once_flag once;
+        AnisotropyData image;
+        double decodeMs = 0.0;
+    };
+    auto inputKey = [&](const ManifestJob& job) { return std::format("{0}\n{1}", normalized(job.input), int(job.inputType)); };
+    std::unordered_map<std::string, DecodedInput> decoded;
+    std::unordered_map<std::string, std::atomic<int>> users;
+    for (const ManifestJob& job : jobs)
+    {
+        decoded[inputKey(job)];
+        ++users[inputKey(job)];
+    }
+
+    {
+        WorkStealingPool pool(pipelineOptions.workerThreads);
+        for (ManifestJob& job : jobs)
+        {
+            pool.submit([&]() {
+                DecodedInput& input = decoded.at(inputKey(job));
+                std::call_once(input.once, [&]() {
+                    auto begin = std::chrono::steady_clock::now();
+                    input.image = loadData(job.input, job.inputType);
+                    input.decodeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+                });
+                job.decodeMs = input.decodeMs;
+                if (input.image.data.empty())
+                {
+                    job.error = "failed to load";
+                    return;
+                }
+
+                auto begin = std::chrono::steady_clock::now();
+                FileJob fileJob;
+                fileJob.filename = job.input;
+                fileJob.loaded = input.image;
+                // the last conversion of an input lets its decoded image go
+                if (--users.at(inputKey(job)) == 0)
+                {
+                    input.image = {};
+                }
+                convertJob(fileJob, job.outputType, job.options);
+                auto converted = std::chrono::steady_clock::now();
+                if (!hasOutput(fileJob))
+                {
+                    job.error = fileJob.error.empty() ? "unsupported conversion" : fileJob.error;
+                    return;
+                }
+                if (!writeJob(fileJob, job.options))
+                {
+                    job.error = "failed to write";
+                    return;
+                }
+                auto written = std::chrono::steady_clock::now();
+                job.convertMs = std::chrono::duration<double, std::milli>(converted - begin).count();
+                job.writeMs = std::chrono::duration<double, std::milli>(written - converted).count();
+
+                std::string output = outputFilename(job.input, fileJob.transformed.type, job.options);
+                std::vector<std::string> files;
+                if (job.options.levels && job.options.format == OutputFormat::ePng)
+                {
+                    for (size_t level = 0; level <= fileJob.mipLevels.size(); ++level)
+                    {
+                        files.push_back(levelFilename(output, job.options.firstLevel + int(level)));
+                    }
+                }
+                else
+                {
+                    files.push_back(output);
+                }
+                for (const std::string& filename : files)
+                {
+                    std::ifstream file(filename, std::ios::binary);
+                    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+                    if (!file || bytes.empty())
+                    {
+                        job.error = "failed to read back " + filename;
+                        return;
+                    }
+                    job.outputs.push_back({ filename, bytes.size(), fnv1a64(bytes.data(), bytes.size()) });
+                }
+                job.ok = true;
+            });
+        }
+        pool.wait();
+    }
+
+    int failures = 0;
+    std::string results;
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        const ManifestJob& job = jobs[i];
+        failures += job.ok ? 0 : 1;
+        std::string outputs;
+        for (const ManifestOutput& output : job.outputs)
+        {
+            outputs += std::format("{0}{{ \"file\": {1}, \"bytes\": {2}, \"fnv1a64\": \"{3:016x}\" }}", outputs.empty() ? "" : ", ", jsonQuoted(output.filename),
+                output.size, output.hash);
+        }
+        results += std::format("    {{ \"input\": {0}, \"inputType\": \"{1}\", \"outputType\": \"{2}\", \"ok\": {3}, {4}\"decodeMs\": {5:.3f}, "
+                               "\"convertMs\": {6:.3f}, \"writeMs\": {7:.3f}, \"outputs\": [{8}] }}{9}\n",
+            jsonQuoted(job.input), typeNames[job.inputType], typeNames[job.outputType], job.ok ? "true" : "false",
+            job.error.empty() ? "" : std::format("\"error\": {0}, ", jsonQuoted(job.error)), job.decodeMs, job.convertMs, job.writeMs, outputs,
+            i + 1 < jobs.size() ? "," : "");
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::ofstream report(resultfilename);
+    report << "{\n";
+    report << std::format("  \"manifest\": {0},\n", jsonQuoted(jobfilename));
+    report << std::format("  \"conversions\": {0},\n  \"inputs\": {1},\n  \"failed\": {2},\n  \"seconds\": {3:.3f},\n", jobs.size(), decoded.size(), failures, seconds);
+    report << "  \"results\": [\n" << results << "  ]\n}\n";
+
+    std::cout << std::format("Manifest: {0} conversions of {1} inputs in {2:.3f}s, {3} failed, results in {4}\n", jobs.size(), decoded.size(), seconds, failures,
+        resultfilename);
+    return failures ? 1 : 0;
+}